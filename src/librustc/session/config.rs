@@ -812,6 +812,8 @@ macro_rules! options {
             Some("a space-separated list of passes, or `all`");
         pub const parse_opt_uint: Option<&str> =
             Some("a number");
+        pub const parse_opt_float: Option<&str> =
+            Some("a floating-point number");
         pub const parse_panic_strategy: Option<&str> =
             Some("either `unwind` or `abort`");
         pub const parse_relro_level: Option<&str> =
@@ -964,6 +966,15 @@ macro_rules! options {
             }
         }
 
+        // The number is kept as it was written, as floats can't be hashed for
+        // dependency tracking.
+        fn parse_opt_float(slot: &mut Option<String>, v: Option<&str>) -> bool {
+            match v {
+                Some(s) if s.parse::<f32>().is_ok() => { *slot = Some(s.to_string()); true }
+                _ => { *slot = None; false }
+            }
+        }
+
         fn parse_passes(slot: &mut Passes, v: Option<&str>) -> bool {
             match v {
                 Some("all") => {
@@ -1233,6 +1244,12 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
         "measure time of rustc processes"),
     time_llvm_passes: bool = (false, parse_bool, [UNTRACKED],
         "measure time of each LLVM pass"),
+    llvm_stats_json: Option<PathBuf> = (None, parse_opt_pathbuf, [UNTRACKED],
+        "write the LLVM statistics and pass timings of each codegen unit as JSON \
+         into the given directory"),
+    llvm_time_trace: Option<PathBuf> = (None, parse_opt_pathbuf, [UNTRACKED],
+        "write a Chrome trace of the work LLVM does for each codegen unit to the given \
+         file (requires LLVM 9 and `-Z no-parallel-llvm`)"),
     input_stats: bool = (false, parse_bool, [UNTRACKED],
         "gather statistics about the input"),
     asm_comments: bool = (false, parse_bool, [TRACKED],
@@ -1399,6 +1416,14 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
         "generate a graphical HTML report of time spent in codegen and LLVM"),
     thinlto: Option<bool> = (None, parse_opt_bool, [TRACKED],
         "enable ThinLTO when possible"),
+    thinlto_import_instr_limit: Option<usize> = (None, parse_opt_uint, [TRACKED],
+        "only import functions with at most this many instructions with ThinLTO"),
+    thinlto_import_cutoff: Option<usize> = (None, parse_opt_uint, [TRACKED],
+        "stop importing functions with ThinLTO after this many imports"),
+    thinlto_import_hot_multiplier: Option<String> = (None, parse_opt_float, [TRACKED],
+        "multiply the ThinLTO import instruction limit by this for hot call sites"),
+    thinlto_import_cold_multiplier: Option<String> = (None, parse_opt_float, [TRACKED],
+        "multiply the ThinLTO import instruction limit by this for cold call sites"),
     inline_in_all_cgus: Option<bool> = (None, parse_opt_bool, [TRACKED],
         "control whether #[inline] functions are in all cgus"),
     tls_model: Option<String> = (None, parse_opt_string, [TRACKED],
@@ -1441,6 +1466,14 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
         "enable the experimental Chalk-based trait solving engine"),
     no_parallel_llvm: bool = (false, parse_bool, [UNTRACKED],
         "don't run LLVM in parallel (while keeping codegen-units and ThinLTO)"),
+    llvm_helper_threads: Option<usize> = (None, parse_opt_uint, [UNTRACKED],
+        "let a single LLVM job use up to N threads; the extra threads are not \
+         accounted for by the jobserver"),
+    thin_archives: bool = (false, parse_bool, [UNTRACKED],
+        "write GNU thin archives whose members are kept in `<archive>.members`"),
+    reuse_archive_symbols: bool = (false, parse_bool, [UNTRACKED],
+        "build the symbol tables of GNU archives from those of the archives \
+         their members are taken from"),
     no_leak_check: bool = (false, parse_bool, [UNTRACKED],
         "disables the 'leak check' for subtyping; unsound, but useful for tests"),
     no_interleave_lints: bool = (false, parse_bool, [UNTRACKED],
@@ -1468,6 +1501,8 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
     symbol_mangling_version: SymbolManglingVersion = (SymbolManglingVersion::Legacy,
         parse_symbol_mangling_version, [TRACKED],
         "which mangling version to use for symbol names"),
+    new_llvm_pass_manager: bool = (false, parse_bool, [TRACKED],
+        "use LLVM's new pass manager to run the optimization pipeline (requires LLVM 9)"),
 }
 
 pub fn default_lib_output() -> CrateType {
@@ -35,7 +35,7 @@ use syntax::symbol::Symbol;
 use syntax_pos::{MultiSpan, Span};
 use crate::util::profiling::SelfProfiler;
 
-use rustc_target::spec::{PanicStrategy, RelroLevel, Target, TargetTriple};
+use rustc_target::spec::{MergeFunctions, PanicStrategy, RelroLevel, Target, TargetTriple};
 use rustc_data_structures::flock;
 use rustc_data_structures::jobserver;
 use ::jobserver::Client;
@@ -1316,6 +1316,18 @@ fn validate_commandline_args_with_session_available(sess: &Session) {
                   with `-Cpanic=unwind` on Windows when targeting MSVC. \
                   See https://github.com/rust-lang/rust/issues/61002 for details.");
     }
+
+    // The new pass manager has no MergeFunctions pass yet, so an explicit
+    // request for one would otherwise be ignored without a trace.
+    if sess.opts.debugging_opts.new_llvm_pass_manager {
+        match sess.opts.debugging_opts.merge_functions {
+            None | Some(MergeFunctions::Disabled) => {}
+            Some(_) => {
+                sess.warn("`-Z merge-functions` has no effect together with \
+                           `-Z new-llvm-pass-manager`");
+            }
+        }
+    }
 }
 
 /// Hash value constructed out of all the `-C metadata` arguments passed to the
@@ -1,6 +1,8 @@
 //! A helper class for dealing with static archives
 
+use std::collections::HashSet;
 use std::ffi::{CString, CStr};
+use std::fs;
 use std::io;
 use std::mem;
 use std::path::{Path, PathBuf};
@@ -12,6 +14,11 @@ use crate::llvm::{self, ArchiveKind};
 use rustc_codegen_ssa::{METADATA_FILENAME, RLIB_BYTECODE_EXTENSION};
 use rustc_codegen_ssa::back::archive::{ArchiveBuilder, find_library};
 use rustc::session::Session;
+use rustc_fs_util::link_or_copy;
+
+/// The file that marks a directory as holding the members of a thin archive
+/// written by rustc, which may be removed when the archive is written again.
+const THIN_MEMBERS_MARKER: &str = ".rustc-thin-archive";
 
 struct ArchiveConfig<'a> {
     pub sess: &'a Session,
@@ -214,7 +221,52 @@ impl<'a> LlvmArchiveBuilder<'a> {
 
     fn llvm_archive_kind(&self) -> Result<ArchiveKind, &str> {
         let kind = &*self.config.sess.target.target.options.archive_format;
-        kind.parse().map_err(|_| kind)
+        match kind.parse().map_err(|_| kind)? {
+            ArchiveKind::K_GNU if self.can_write_thin_archive() => Ok(ArchiveKind::K_GNUThin),
+            kind => Ok(kind),
+        }
+    }
+
+    /// Whether a thin archive can be written with `-Z thin-archives`. A thin
+    /// archive can only reference files, so nothing may come from another
+    /// archive, and the files are kept under their names in the archive, so
+    /// those have to be unique.
+    fn can_write_thin_archive(&self) -> bool {
+        let mut names = HashSet::new();
+        self.config.sess.opts.debugging_opts.thin_archives &&
+            self.config.src.is_none() &&
+            self.additions.iter().all(|addition| match addition {
+                Addition::File { name_in_archive, .. } => names.insert(name_in_archive),
+                Addition::Archive { .. } => false,
+            })
+    }
+
+    /// The directory next to the archive which holds the members of a thin
+    /// archive, as the files added to it are usually temporaries of the link.
+    fn thin_members_dir(&self) -> PathBuf {
+        let mut name = self.config.dst.file_name().unwrap().to_owned();
+        name.push(".members");
+        self.config.dst.with_file_name(name)
+    }
+
+    /// Removes the members of a thin archive written to the same path before,
+    /// and with `keep_members` prepares the directory for the new ones. Only a
+    /// directory holding `THIN_MEMBERS_MARKER` was created here, anything else
+    /// at that path is left alone.
+    fn reset_thin_members_dir(&self, keep_members: bool) -> io::Result<PathBuf> {
+        let dir = self.thin_members_dir();
+        if dir.join(THIN_MEMBERS_MARKER).is_file() {
+            fs::remove_dir_all(&dir)?;
+        } else if keep_members && fs::symlink_metadata(&dir).is_ok() {
+            return Err(io::Error::new(io::ErrorKind::AlreadyExists,
+                format!("`{}` already exists and does not hold thin archive members",
+                        dir.display())));
+        }
+        if keep_members {
+            fs::create_dir_all(&dir)?;
+            fs::File::create(dir.join(THIN_MEMBERS_MARKER))?;
+        }
+        Ok(dir)
     }
 
     fn build_with_llvm(&mut self, kind: ArchiveKind) -> io::Result<()> {
@@ -225,29 +277,35 @@ impl<'a> LlvmArchiveBuilder<'a> {
 
         let dst = CString::new(self.config.dst.to_str().unwrap())?;
         let should_update_symbols = self.should_update_symbols;
+        let reuse_symbols = self.config.sess.opts.debugging_opts.reuse_archive_symbols;
+
+        // Members of the source archive are taken over by
+        // `LLVMRustUpdateArchive` itself, which avoids re-reading them.
+        let removals = removals.iter()
+                               .map(|r| CString::new(r.as_str()))
+                               .collect::<Result<Vec<_>, _>>()?;
+        let removal_ptrs = removals.iter().map(|r| r.as_ptr()).collect::<Vec<_>>();
+
+        let thin_members_dir = if self.config.sess.opts.debugging_opts.thin_archives {
+            let thin = match kind {
+                ArchiveKind::K_GNUThin => true,
+                _ => false,
+            };
+            let dir = self.reset_thin_members_dir(thin)?;
+            if thin { Some(dir) } else { None }
+        } else {
+            None
+        };
 
         unsafe {
-            if let Some(archive) = self.src_archive() {
-                for child in archive.iter() {
-                    let child = child.map_err(string_to_io_error)?;
-                    let child_name = match child.name() {
-                        Some(s) => s,
-                        None => continue,
-                    };
-                    if removals.iter().any(|r| r == child_name) {
-                        continue
-                    }
-
-                    let name = CString::new(child_name)?;
-                    members.push(llvm::LLVMRustArchiveMemberNew(ptr::null(),
-                                                                name.as_ptr(),
-                                                                Some(child.raw)));
-                    strings.push(name);
-                }
-            }
             for addition in &mut additions {
                 match addition {
                     Addition::File { path, name_in_archive } => {
+                        if let Some(ref dir) = thin_members_dir {
+                            let member = dir.join(&*name_in_archive);
+                            link_or_copy(&*path, &member)?;
+                            *path = member;
+                        }
                         let path = CString::new(path.to_str().unwrap())?;
                         let name = CString::new(name_in_archive.clone())?;
                         members.push(llvm::LLVMRustArchiveMemberNew(path.as_ptr(),
@@ -287,11 +345,23 @@ impl<'a> LlvmArchiveBuilder<'a> {
                 }
             }
 
-            let r = llvm::LLVMRustWriteArchive(dst.as_ptr(),
-                                               members.len() as libc::size_t,
-                                               members.as_ptr() as *const &_,
-                                               should_update_symbols,
-                                               kind);
+            let r = match self.src_archive() {
+                Some(archive) => llvm::LLVMRustUpdateArchive(dst.as_ptr(),
+                                                             archive.raw,
+                                                             removal_ptrs.len() as libc::size_t,
+                                                             removal_ptrs.as_ptr(),
+                                                             members.len() as libc::size_t,
+                                                             members.as_ptr() as *const &_,
+                                                             should_update_symbols,
+                                                             reuse_symbols,
+                                                             kind),
+                None => llvm::LLVMRustWriteArchive(dst.as_ptr(),
+                                                   members.len() as libc::size_t,
+                                                   members.as_ptr() as *const &_,
+                                                   should_update_symbols,
+                                                   reuse_symbols,
+                                                   kind),
+            };
             let ret = if r.into_result().is_err() {
                 let err = llvm::LLVMRustGetLastError();
                 let msg = if err.is_null() {
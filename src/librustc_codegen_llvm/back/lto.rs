@@ -3,6 +3,7 @@ use crate::back::write::{self, DiagnosticHandlers, with_llvm_pmb, save_temp_bitc
     to_llvm_opt_settings};
 use crate::llvm::archive_ro::ArchiveRO;
 use crate::llvm::{self, True, False};
+use crate::llvm_util;
 use crate::{ModuleLlvm, LlvmCodegenBackend};
 use rustc_codegen_ssa::back::symbol_export;
 use rustc_codegen_ssa::back::write::{ModuleConfig, CodegenContext, FatLTOInput};
@@ -19,9 +20,19 @@ use rustc_data_structures::fx::FxHashMap;
 use rustc_codegen_ssa::{RLIB_BYTECODE_EXTENSION, ModuleCodegen, ModuleKind};
 
 use std::ffi::{CStr, CString};
+use std::fs;
+use std::io;
+use std::panic;
+use std::path::Path;
 use std::ptr;
 use std::slice;
 use std::sync::Arc;
+use std::sync::mpsc;
+use std::thread;
+
+/// Name of the file in the incremental session directory that holds the
+/// ThinLTO cache keys of all modules from the previous compilation.
+const THIN_LTO_KEYS_INCR_COMP_FILE_NAME: &str = "thin-lto-past-keys.txt";
 
 pub fn crate_type_allows_lto(crate_type: config::CrateType) -> bool {
     match crate_type {
@@ -104,8 +115,8 @@ fn prepare_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     .filter_map(symbol_filter));
 
             let archive = ArchiveRO::open(&path).expect("wanted an rlib");
-            let bytecodes = archive.iter().filter_map(|child| {
-                child.ok().and_then(|c| c.name().map(|name| (name, c)))
+            let bytecodes = archive.members().into_iter().filter_map(|member| {
+                member.name().map(|name| (name, member))
             }).filter(|&(name, _)| name.ends_with(RLIB_BYTECODE_EXTENSION));
             for (name, data) in bytecodes {
                 info!("adding bytecode {}", name);
@@ -185,7 +196,7 @@ fn fat_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
            diag_handler: &Handler,
            mut modules: Vec<FatLTOInput<LlvmCodegenBackend>>,
            cached_modules: Vec<(SerializedModule<ModuleBuffer>, WorkProduct)>,
-           mut serialized_modules: Vec<(SerializedModule<ModuleBuffer>, CString)>,
+           serialized_modules: Vec<(SerializedModule<ModuleBuffer>, CString)>,
            symbol_white_list: &[*const libc::c_char])
     -> Result<LtoModuleCodegen<LlvmCodegenBackend>, FatalError>
 {
@@ -265,7 +276,13 @@ fn fat_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
         // and we want to move everything to the same LLVM context. Currently the
         // way we know of to do that is to serialize them to a string and them parse
         // them later. Not great but hey, that's why it's "fat" LTO, right?
-        serialized_modules.extend(modules.into_iter().map(|module| {
+        //
+        // Serializing a module only involves its own context, so if we may use
+        // helper threads for LLVM this happens on a separate thread, module by
+        // module, while the upstream modules, which are serialized already,
+        // are being linked. The modules are still linked in the same order as
+        // if everything was serialized upfront.
+        let serialize = |module: FatLTOInput<LlvmCodegenBackend>| {
             match module {
                 FatLTOInput::InMemory(module) => {
                     let buffer = ModuleBuffer::new(module.module_llvm.llmod());
@@ -277,17 +294,36 @@ fn fat_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     (SerializedModule::Local(buffer), llmod_id)
                 }
             }
-        }));
-        serialized_modules.extend(cached_modules.into_iter().map(|(buffer, wp)| {
+        };
+        let (tx, local_modules) = mpsc::channel();
+        let serializer = if llvm_util::max_helper_threads(&cgcx.opts) <= 1 {
+            for module in modules {
+                tx.send(serialize(module)).unwrap();
+            }
+            drop(tx);
+            None
+        } else {
+            Some(thread::spawn(move || {
+                for module in modules {
+                    if tx.send(serialize(module)).is_err() {
+                        break
+                    }
+                }
+            }))
+        };
+        let cached_modules = cached_modules.into_iter().map(|(buffer, wp)| {
             (buffer, CString::new(wp.cgu_name).unwrap())
-        }));
+        });
 
         // For all serialized bitcode files we parse them and link them in as we did
         // above, this is all mostly handled in C++. Like above, though, we don't
         // know much about the memory management here so we err on the side of being
         // save and persist everything with the original module.
         let mut linker = Linker::new(llmod);
-        for (bc_decoded, name) in serialized_modules {
+        let all_modules = serialized_modules.into_iter()
+            .chain(local_modules.iter())
+            .chain(cached_modules);
+        for (bc_decoded, name) in all_modules {
             info!("linking {:?}", name);
             time_ext(cgcx.time_passes, None, &format!("ll link {:?}", name), || {
                 let data = bc_decoded.data();
@@ -298,6 +334,12 @@ fn fat_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
             })?;
             serialized_bitcode.push(bc_decoded);
         }
+        // If serializing panicked we didn't see all modules, so don't go on.
+        if let Some(serializer) = serializer {
+            if let Err(payload) = serializer.join() {
+                panic::resume_unwind(payload);
+            }
+        }
         drop(linker);
         save_temp_bitcode(&cgcx, &module, "lto.input");
 
@@ -477,6 +519,37 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
 
         let data = ThinData(data);
 
+        // With incremental compilation, compare the cache key of each module
+        // with the one it had in the previous compilation session. The keys
+        // are `None` if this LLVM can't compute them.
+        let (prev_key_map, curr_key_map) = match cgcx.incr_comp_session_dir {
+            Some(ref incr_comp_session_dir) => {
+                let path = incr_comp_session_dir.join(THIN_LTO_KEYS_INCR_COMP_FILE_NAME);
+                let prev_key_map = if path.exists() {
+                    Some(ThinLTOKeysMap::load_from_file(&path).map_err(|e| {
+                        let msg = format!("failed to read ThinLTO keys from {}: {}",
+                                          path.display(), e);
+                        diag_handler.fatal(&msg)
+                    })?)
+                } else {
+                    None
+                };
+                let curr_key_map = ThinLTOKeysMap::from_thin_lto_data(&data.0, &module_names);
+                if let Some(ref curr_key_map) = curr_key_map {
+                    curr_key_map.save_to_file(&path).map_err(|e| {
+                        let msg = format!("failed to write ThinLTO keys to {}: {}",
+                                          path.display(), e);
+                        diag_handler.fatal(&msg)
+                    })?;
+                }
+                (prev_key_map, curr_key_map)
+            }
+            None => (None, None),
+        };
+        if curr_key_map.is_some() {
+            info!("thin LTO cache keys computed");
+        }
+
         // Throw our data in an `Arc` as we'll be sharing it across threads. We
         // also put all memory referenced by the C++ data (buffers, ids, etc)
         // into the arc as well. After this we'll create a thin module
@@ -497,13 +570,22 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
 
             // If the module hasn't changed and none of the modules it imports
             // from has changed, we can re-use the post-ThinLTO version of the
-            // module.
+            // module. Its cache key also has to be the same as before, as it
+            // additionally catches changes to what the module exports and to
+            // the linkage of the symbols it defines.
             if green_modules.contains_key(module_name) {
                 let imports_all_green = import_map.modules_imported_by(module_name)
                     .iter()
                     .all(|imported_module| green_modules.contains_key(imported_module));
+                let key_unchanged = match (&prev_key_map, &curr_key_map) {
+                    (Some(prev), Some(curr)) => {
+                        prev.keys.get(module_name) == curr.keys.get(module_name)
+                    }
+                    (None, Some(_)) => false,
+                    (_, None) => true,
+                };
 
-                if imports_all_green {
+                if imports_all_green && key_unchanged {
                     let work_product = green_modules[module_name].clone();
                     copy_jobs.push(work_product);
                     info!(" - {}: re-used", module_name);
@@ -527,7 +609,7 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
 pub(crate) fn run_pass_manager(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     module: &ModuleCodegen<ModuleLlvm>,
                     config: &ModuleConfig,
-                    thin: bool) {
+                    thin: bool) -> Result<(), FatalError> {
     // Now we have one massive module inside of llmod. Time to run the
     // LTO-specific optimization passes that LLVM provides.
     //
@@ -535,6 +617,20 @@ pub(crate) fn run_pass_manager(cgcx: &CodegenContext<LlvmCodegenBackend>,
     //      tools/lto/LTOCodeGenerator.cpp
     debug!("running the pass manager");
     unsafe {
+        if config.new_llvm_pass_manager {
+            let opt_stage = if thin { llvm::OptStage::ThinLTO } else { llvm::OptStage::FatLTO };
+            // As with the legacy pass manager below, never run LTO at `-O0`.
+            let opt_level = match config.opt_level {
+                None | Some(config::OptLevel::No) => config::OptLevel::Less,
+                Some(level) => level,
+            };
+            let diag_handler = cgcx.create_diag_handler();
+            write::optimize_with_new_llvm_pass_manager(cgcx, &diag_handler, module, config,
+                                                       opt_level, opt_stage)?;
+            debug!("lto done");
+            return Ok(());
+        }
+
         let pm = llvm::LLVMCreatePassManager();
         llvm::LLVMRustAddAnalysisPasses(module.module_llvm.tm, pm, module.module_llvm.llmod());
 
@@ -589,6 +685,7 @@ pub(crate) fn run_pass_manager(cgcx: &CodegenContext<LlvmCodegenBackend>,
         llvm::LLVMDisposePassManager(pm);
     }
     debug!("lto done");
+    Ok(())
 }
 
 pub struct ModuleBuffer(&'static mut llvm::ModuleBuffer);
@@ -610,7 +707,7 @@ impl ModuleBuffer {
         handler: &Handler,
     ) -> Result<&'a llvm::Module, FatalError> {
         let name = CString::new(name).unwrap();
-        parse_module(cx, &name, self.data(), handler)
+        parse_module(cx, &name, self.data(), None, handler)
     }
 }
 
@@ -689,11 +786,15 @@ pub unsafe fn optimize_thin_module(
     // into that context. One day, however, we may do this for upstream
     // crates but for locally codegened modules we may be able to reuse
     // that LLVM Context and Module.
+    //
+    // Passing the ThinLTO data along lets the parser skip the bodies of
+    // functions the combined index has found to be dead.
     let llcx = llvm::LLVMRustContextCreate(cgcx.fewer_names);
     let llmod_raw = parse_module(
         llcx,
         &thin_module.shared.module_names[thin_module.idx],
         thin_module.data(),
+        Some(&*thin_module.shared.data.0),
         &diag_handler,
     )? as *const _;
     let module = ModuleCodegen {
@@ -797,7 +898,7 @@ pub unsafe fn optimize_thin_module(
         // little differently.
         info!("running thin lto passes over {}", module.name);
         let config = cgcx.config(module.kind);
-        run_pass_manager(cgcx, &module, config, true);
+        run_pass_manager(cgcx, &module, config, true)?;
         save_temp_bitcode(cgcx, &module, "thin-lto-after-pm");
     }
     Ok(module)
@@ -842,6 +943,58 @@ impl ThinLTOImports {
     }
 }
 
+/// The ThinLTO cache keys of all modules, see `LLVMRustComputeLTOCacheKey`.
+#[derive(Debug, Default)]
+struct ThinLTOKeysMap {
+    // key = llvm name of module, value = its cache key
+    keys: FxHashMap<String, String>,
+}
+
+impl ThinLTOKeysMap {
+    /// Computes the keys of `module_names` from ThinLTOData, or returns `None`
+    /// if LLVM is too old to do so.
+    unsafe fn from_thin_lto_data(data: &llvm::ThinLTOData,
+                                 module_names: &[CString]) -> Option<ThinLTOKeysMap> {
+        let mut keys = FxHashMap::default();
+        for name in module_names {
+            let mut result = Ok(());
+            let key = llvm::build_string(|s| {
+                result = llvm::LLVMRustComputeLTOCacheKey(s, name.as_ptr(), data).into_result();
+            }).expect("non-UTF8 ThinLTO cache key");
+            if result.is_err() {
+                info!("failed to compute ThinLTO cache keys: {:?}", llvm::last_error());
+                return None;
+            }
+            keys.insert(module_name_to_str(name).to_owned(), key);
+        }
+        Some(ThinLTOKeysMap { keys })
+    }
+
+    fn save_to_file(&self, path: &Path) -> io::Result<()> {
+        let mut contents = String::new();
+        for (module, key) in &self.keys {
+            contents.push_str(&format!("{} {}\n", module, key));
+        }
+        // The file may be a hard link into the previous session directory, so
+        // replace it instead of writing through it.
+        if path.exists() {
+            fs::remove_file(path)?;
+        }
+        fs::write(path, contents)
+    }
+
+    fn load_from_file(path: &Path) -> io::Result<ThinLTOKeysMap> {
+        let contents = fs::read_to_string(path)?;
+        let keys = contents.lines().filter_map(|line| {
+            let mut split = line.rsplitn(2, ' ');
+            let key = split.next()?;
+            let module = split.next()?;
+            Some((module.to_owned(), key.to_owned()))
+        }).collect();
+        Ok(ThinLTOKeysMap { keys })
+    }
+}
+
 fn module_name_to_str(c_str: &CStr) -> &str {
     c_str.to_str().unwrap_or_else(|e|
         bug!("Encountered non-utf8 LLVM module name `{}`: {}", c_str.to_string_lossy(), e))
@@ -851,6 +1004,7 @@ fn parse_module<'a>(
     cx: &'a llvm::Context,
     name: &CStr,
     data: &[u8],
+    thin_data: Option<&llvm::ThinLTOData>,
     diag_handler: &Handler,
 ) -> Result<&'a llvm::Module, FatalError> {
     unsafe {
@@ -859,6 +1013,7 @@ fn parse_module<'a>(
             data.as_ptr(),
             data.len(),
             name.as_ptr(),
+            thin_data,
         ).ok_or_else(|| {
             let msg = "failed to parse bitcode for LTO module";
             write::llvm_err(&diag_handler, msg)
@@ -3,7 +3,7 @@ use crate::back::bytecode;
 use crate::back::lto::ThinBuffer;
 use crate::base;
 use crate::consts;
-use crate::llvm::{self, DiagnosticInfo, PassManager, SMDiagnostic};
+use crate::llvm::{self, DiagnosticInfo, SMDiagnostic};
 use crate::llvm_util;
 use crate::ModuleLlvm;
 use crate::type_::Type;
@@ -62,23 +62,144 @@ pub fn llvm_err(handler: &errors::Handler, msg: &str) -> FatalError {
     }
 }
 
-pub fn write_output_file(
+/// Runs `f`, which does the work of `phase` for the module `module_name`, with
+/// the LLVM instrumentation requested on the command line:
+///
+/// * With `-Z llvm-time-trace`, the work is recorded as an event in LLVM's
+///   time-trace profiler, tagged with the module name and the current thread.
+/// * With `-Z llvm-stats-json`, the LLVM statistics and pass timings that
+///   changed meanwhile are written to `<dir>/<module_name>.<phase>.json`.
+///   LLVM only keeps process-wide counters, so the numbers recorded for a
+///   module also include whatever other modules did concurrently. Use
+///   `-Z no-parallel-llvm` to get exact numbers per codegen unit.
+pub(crate) fn with_llvm_instrumentation<R>(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                                           diag_handler: &Handler,
+                                           module_name: &str,
+                                           phase: &str,
+                                           f: impl FnOnce() -> R) -> R {
+    if cgcx.opts.debugging_opts.llvm_time_trace.is_some() {
+        let name = SmallCStr::new(phase);
+        let detail = format!("{} ({:?})", module_name, std::thread::current().id());
+        let detail = SmallCStr::new(&detail);
+        unsafe { llvm::LLVMRustTimeTraceProfilerBegin(name.as_ptr(), detail.as_ptr()); }
+        let result = with_llvm_stats(cgcx, diag_handler, module_name, phase, f);
+        unsafe { llvm::LLVMRustTimeTraceProfilerEnd(); }
+        result
+    } else {
+        with_llvm_stats(cgcx, diag_handler, module_name, phase, f)
+    }
+}
+
+fn with_llvm_stats<R>(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                      diag_handler: &Handler,
+                      module_name: &str,
+                      phase: &str,
+                      f: impl FnOnce() -> R) -> R {
+    let dir = match cgcx.opts.debugging_opts.llvm_stats_json {
+        Some(ref dir) => dir,
+        None => return f(),
+    };
+    let before = match unsafe { llvm::LLVMRustStatisticsSnapshotCreate() } {
+        Some(before) => before,
+        None => {
+            let msg = llvm::last_error().unwrap_or_else(|| "unknown error".to_string());
+            diag_handler.warn(&format!("failed to collect LLVM statistics: {}", msg));
+            return f();
+        }
+    };
+
+    let result = f();
+
+    let module_name_c = SmallCStr::new(module_name);
+    let phase_c = SmallCStr::new(phase);
+    let mut diff = Ok(());
+    let json = llvm::build_string(|s| unsafe {
+        diff = llvm::LLVMRustStatisticsSnapshotDiff(before,
+                                                    module_name_c.as_ptr(),
+                                                    phase_c.as_ptr(),
+                                                    s).into_result();
+    }).expect("non-UTF8 JSON from LLVMRustStatisticsSnapshotDiff");
+    unsafe { llvm::LLVMRustStatisticsSnapshotFree(before); }
+
+    if diff.is_err() {
+        let msg = llvm::last_error().unwrap_or_else(|| "unknown error".to_string());
+        diag_handler.warn(&format!("failed to collect LLVM statistics: {}", msg));
+        return result;
+    }
+
+    let out = dir.join(format!("{}.{}.json", module_name, phase));
+    if let Err(e) = fs::create_dir_all(dir).and_then(|()| fs::write(&out, json)) {
+        let msg = format!("failed to write LLVM statistics to {}: {}", out.display(), e);
+        diag_handler.err(&msg);
+    }
+    result
+}
+
+/// Writes the textual IR, assembly and object file of `m` to the given paths in
+/// a single call, skipping any artifact whose path is `None`.
+pub fn write_output_files(
         handler: &errors::Handler,
         target: &'ll llvm::TargetMachine,
-        pm: &llvm::PassManager<'ll>,
         m: &'ll llvm::Module,
-        output: &Path,
-        file_type: llvm::FileType) -> Result<(), FatalError> {
+        ir_output: Option<&Path>,
+        asm_output: Option<&Path>,
+        obj_output: Option<&Path>,
+        no_builtins: bool) -> Result<(), FatalError> {
+    use std::ptr;
+
+    let ir_c = ir_output.map(path_to_c_string);
+    let asm_c = asm_output.map(path_to_c_string);
+    let obj_c = obj_output.map(path_to_c_string);
+    let as_ptr = |s: &Option<CString>| s.as_ref().map_or(ptr::null(), |s| s.as_ptr());
     unsafe {
-        let output_c = path_to_c_string(output);
-        let result = llvm::LLVMRustWriteOutputFile(target, pm, m, output_c.as_ptr(), file_type);
+        let result = llvm::LLVMRustWriteOutputFiles(target, m,
+                                                    as_ptr(&ir_c),
+                                                    as_ptr(&asm_c),
+                                                    as_ptr(&obj_c),
+                                                    no_builtins,
+                                                    demangle_callback);
         result.into_result().map_err(|()| {
-            let msg = format!("could not write output to {}", output.display());
+            let outputs = ir_output.iter().chain(&asm_output).chain(&obj_output)
+                .map(|p| p.display().to_string())
+                .collect::<Vec<_>>()
+                .join(", ");
+            let msg = format!("could not write output to {}", outputs);
             llvm_err(handler, &msg)
         })
     }
 }
 
+extern "C" fn demangle_callback(input_ptr: *const c_char,
+                                input_len: size_t,
+                                output_ptr: *mut c_char,
+                                output_len: size_t) -> size_t {
+    let input = unsafe {
+        slice::from_raw_parts(input_ptr as *const u8, input_len as usize)
+    };
+
+    let input = match str::from_utf8(input) {
+        Ok(s) => s,
+        Err(_) => return 0,
+    };
+
+    let output = unsafe {
+        slice::from_raw_parts_mut(output_ptr as *mut u8, output_len as usize)
+    };
+    let mut cursor = io::Cursor::new(output);
+
+    let demangled = match rustc_demangle::try_demangle(input) {
+        Ok(d) => d,
+        Err(_) => return 0,
+    };
+
+    if let Err(_) = write!(cursor, "{:#}", demangled) {
+        // Possible only if provided buffer is not big enough
+        return 0;
+    }
+
+    cursor.position() as size_t
+}
+
 pub fn create_informational_target_machine(
     sess: &Session,
     find_features: bool,
@@ -167,9 +288,12 @@ pub fn target_machine_factory(sess: &Session, optlvl: config::OptLevel, find_fea
 
     let asm_comments = sess.asm_comments();
 
+    // Target machines are borrowed from a pool in rustllvm and handed back to
+    // it by `LLVMRustDisposeTargetMachine`, so codegen units and LTO jobs
+    // with the same configuration don't each have to build one from scratch.
     Arc::new(move || {
         let tm = unsafe {
-            llvm::LLVMRustCreateTargetMachine(
+            llvm::LLVMRustGetCachedTargetMachine(
                 triple.as_ptr(), cpu.as_ptr(), features.as_ptr(),
                 code_model,
                 reloc_model,
@@ -320,6 +444,19 @@ pub(crate) unsafe fn optimize(cgcx: &CodegenContext<LlvmCodegenBackend>,
         llvm::LLVMWriteBitcodeToFile(llmod, out.as_ptr());
     }
 
+    if let Some(opt_level) = config.opt_level {
+        if config.new_llvm_pass_manager {
+            let opt_stage = match cgcx.lto {
+                Lto::Fat => llvm::OptStage::PreLinkFatLTO,
+                Lto::Thin | Lto::ThinLocal => llvm::OptStage::PreLinkThinLTO,
+                _ if cgcx.opts.cg.linker_plugin_lto.enabled() => llvm::OptStage::PreLinkThinLTO,
+                _ => llvm::OptStage::PreLinkNoLTO,
+            };
+            return optimize_with_new_llvm_pass_manager(cgcx, diag_handler, module, config,
+                                                       opt_level, opt_stage);
+        }
+    }
+
     if config.opt_level.is_some() {
         // Create the two optimizing pass managers. These mirror what clang
         // does, and are by populated by LLVM's default PassManagerBuilder.
@@ -448,6 +585,83 @@ pub(crate) unsafe fn optimize(cgcx: &CodegenContext<LlvmCodegenBackend>,
     Ok(())
 }
 
+fn to_pass_builder_opt_level(cfg: config::OptLevel) -> llvm::PassBuilderOptLevel {
+    use self::config::OptLevel::*;
+    match cfg {
+        No => llvm::PassBuilderOptLevel::O0,
+        Less => llvm::PassBuilderOptLevel::O1,
+        Default => llvm::PassBuilderOptLevel::O2,
+        Aggressive => llvm::PassBuilderOptLevel::O3,
+        Size => llvm::PassBuilderOptLevel::Os,
+        SizeMin => llvm::PassBuilderOptLevel::Oz,
+    }
+}
+
+// Runs the optimization pipeline of `opt_stage` over `module` using LLVM's new
+// pass manager. This is the `-Z new-llvm-pass-manager` counterpart of the
+// `PassManagerBuilder` based pipeline set up in `optimize` and
+// `lto::run_pass_manager`.
+pub(crate) unsafe fn optimize_with_new_llvm_pass_manager(
+    cgcx: &CodegenContext<LlvmCodegenBackend>,
+    diag_handler: &Handler,
+    module: &ModuleCodegen<ModuleLlvm>,
+    config: &ModuleConfig,
+    opt_level: config::OptLevel,
+    opt_stage: llvm::OptStage,
+) -> Result<(), FatalError> {
+    use std::ptr;
+
+    let llmod = module.module_llvm.llmod();
+    let tm = &*module.module_llvm.tm;
+
+    // Match the legacy pipeline, which disables loop unrolling when optimizing
+    // for size.
+    let unroll_loops = opt_level != config::OptLevel::Size &&
+                       opt_level != config::OptLevel::SizeMin;
+    let using_thin_buffers = opt_stage == llvm::OptStage::PreLinkThinLTO ||
+                             config.bitcode_needed();
+
+    let pgo_gen_path = get_pgo_gen_path(config);
+    let pgo_use_path = get_pgo_use_path(config);
+
+    // Extra passes are given in the textual pipeline syntax of the new pass
+    // manager, which for single passes coincides with the legacy pass names.
+    let extra_passes = config.passes.iter()
+        .chain(cgcx.plugin_passes.iter())
+        .map(|pass| SmallCStr::new(pass))
+        .collect::<Vec<_>>();
+    let extra_passes = extra_passes.iter().map(|pass| pass.as_ptr()).collect::<Vec<_>>();
+
+    let module_name = &module.name[..];
+    let _timer = cgcx.profile_activity("LLVM_module_passes");
+    time_ext(config.time_passes,
+             None,
+             &format!("llvm module passes [{}]", module_name),
+             || {
+        llvm::LLVMRustOptimizeWithNewPassManager(
+            llmod,
+            tm,
+            to_pass_builder_opt_level(opt_level),
+            opt_stage,
+            config.no_prepopulate_passes,
+            config.verify_llvm_ir,
+            using_thin_buffers,
+            config.merge_functions,
+            unroll_loops,
+            config.vectorize_slp,
+            config.vectorize_loop,
+            config.no_builtins,
+            pgo_gen_path.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+            pgo_use_path.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+            extra_passes.as_ptr(),
+            extra_passes.len() as size_t,
+        )
+    }).into_result().map_err(|()| {
+        let msg = format!("failed to optimize {} with the new pass manager", module_name);
+        llvm_err(diag_handler, &msg)
+    })
+}
+
 pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
                   diag_handler: &Handler,
                   module: ModuleCodegen<ModuleLlvm>,
@@ -467,26 +681,6 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
             create_msvc_imps(cgcx, llcx, llmod);
         }
 
-        // A codegen-specific pass manager is used to generate object
-        // files for an LLVM module.
-        //
-        // Apparently each of these pass managers is a one-shot kind of
-        // thing, so we create a new one for each type of output. The
-        // pass manager passed to the closure should be ensured to not
-        // escape the closure itself, and the manager should only be
-        // used once.
-        unsafe fn with_codegen<'ll, F, R>(tm: &'ll llvm::TargetMachine,
-                                          llmod: &'ll llvm::Module,
-                                          no_builtins: bool,
-                                          f: F) -> R
-            where F: FnOnce(&'ll mut PassManager<'ll>) -> R,
-        {
-            let cpm = llvm::LLVMCreatePassManager();
-            llvm::LLVMRustAddAnalysisPasses(tm, cpm, llmod);
-            llvm::LLVMRustAddLibraryInfo(cpm, llmod, no_builtins);
-            f(cpm)
-        }
-
         // If we don't have the integrated assembler, then we need to emit asm
         // from LLVM and use `gcc` to create the object file.
         let asm_to_obj = config.emit_obj && config.no_integrated_as;
@@ -537,78 +731,44 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
 
         time_ext(config.time_passes, None, &format!("codegen passes [{}]", module_name.unwrap()),
             || -> Result<(), FatalError> {
-            if config.emit_ir {
-                let _timer = cgcx.profile_activity("LLVM_emit_ir");
-                let out = cgcx.output_filenames.temp_path(OutputType::LlvmAssembly, module_name);
-                let out_c = path_to_c_string(&out);
-
-                extern "C" fn demangle_callback(input_ptr: *const c_char,
-                                                input_len: size_t,
-                                                output_ptr: *mut c_char,
-                                                output_len: size_t) -> size_t {
-                    let input = unsafe {
-                        slice::from_raw_parts(input_ptr as *const u8, input_len as usize)
-                    };
-
-                    let input = match str::from_utf8(input) {
-                        Ok(s) => s,
-                        Err(_) => return 0,
-                    };
-
-                    let output = unsafe {
-                        slice::from_raw_parts_mut(output_ptr as *mut u8, output_len as usize)
-                    };
-                    let mut cursor = io::Cursor::new(output);
-
-                    let demangled = match rustc_demangle::try_demangle(input) {
-                        Ok(d) => d,
-                        Err(_) => return 0,
-                    };
-
-                    if let Err(_) = write!(cursor, "{:#}", demangled) {
-                        // Possible only if provided buffer is not big enough
-                        return 0;
-                    }
-
-                    cursor.position() as size_t
-                }
+            let ir_out = if config.emit_ir {
+                Some(cgcx.output_filenames.temp_path(OutputType::LlvmAssembly, module_name))
+            } else {
+                None
+            };
+            let asm_out = if config.emit_asm || asm_to_obj {
+                Some(cgcx.output_filenames.temp_path(OutputType::Assembly, module_name))
+            } else {
+                None
+            };
 
-                with_codegen(tm, llmod, config.no_builtins, |cpm| {
-                    let result =
-                        llvm::LLVMRustPrintModule(cpm, llmod, out_c.as_ptr(), demangle_callback);
-                    llvm::LLVMDisposePassManager(cpm);
-                    result.into_result().map_err(|()| {
-                        let msg = format!("failed to write LLVM IR to {}", out.display());
-                        llvm_err(diag_handler, &msg)
-                    })
-                })?;
+            if let Some(ref ir_out) = ir_out {
+                let _timer = cgcx.profile_activity("LLVM_emit_ir");
+                write_output_files(diag_handler, tm, llmod,
+                                   Some(ir_out), None, None,
+                                   config.no_builtins)?;
             }
 
-            if config.emit_asm || asm_to_obj {
-                let _timer = cgcx.profile_activity("LLVM_emit_asm");
-                let path = cgcx.output_filenames.temp_path(OutputType::Assembly, module_name);
-
-                // We can't use the same module for asm and binary output, because that triggers
-                // various errors like invalid IR or broken binaries, so we might have to clone the
-                // module to produce the asm output
-                let llmod = if config.emit_obj {
-                    llvm::LLVMCloneModule(llmod)
+            // Assembly and object file are written by a single call, which
+            // takes care of not running codegen twice on the same module. The
+            // two are generated concurrently, so both events cover the call.
+            if asm_out.is_some() || write_obj {
+                let _asm_timer = asm_out.as_ref().map(|_| {
+                    cgcx.profile_activity("LLVM_emit_asm")
+                });
+                let _obj_timer = if write_obj {
+                    Some(cgcx.profile_activity("LLVM_emit_obj"))
                 } else {
-                    llmod
+                    None
                 };
-                with_codegen(tm, llmod, config.no_builtins, |cpm| {
-                    write_output_file(diag_handler, tm, cpm, llmod, &path,
-                                      llvm::FileType::AssemblyFile)
-                })?;
+                write_output_files(diag_handler, tm, llmod,
+                                   None,
+                                   asm_out.as_ref().map(|p| &**p),
+                                   if write_obj { Some(&*obj_out) } else { None },
+                                   config.no_builtins)?;
             }
 
-            if write_obj {
-                let _timer = cgcx.profile_activity("LLVM_emit_obj");
-                with_codegen(tm, llmod, config.no_builtins, |cpm| {
-                    write_output_file(diag_handler, tm, cpm, llmod, &obj_out,
-                                      llvm::FileType::ObjectFile)
-                })?;
-            } else if asm_to_obj {
+            if asm_to_obj {
                 let _timer = cgcx.profile_activity("LLVM_asm_to_obj");
                 let assembly = cgcx.output_filenames.temp_path(OutputType::Assembly, module_name);
                 run_assembler(cgcx, diag_handler, &assembly, &obj_out);
@@ -701,6 +861,29 @@ unsafe fn embed_bitcode(cgcx: &CodegenContext<LlvmCodegenBackend>,
     llvm::LLVMRustSetLinkage(llglobal, llvm::Linkage::PrivateLinkage);
 }
 
+fn get_pgo_gen_path(config: &ModuleConfig) -> Option<CString> {
+    match config.pgo_gen {
+        SwitchWithOptPath::Enabled(ref opt_dir_path) => {
+            let path = if let Some(dir_path) = opt_dir_path {
+                dir_path.join("default_%m.profraw")
+            } else {
+                PathBuf::from("default_%m.profraw")
+            };
+
+            Some(CString::new(format!("{}", path.display())).unwrap())
+        }
+        SwitchWithOptPath::Disabled => {
+            None
+        }
+    }
+}
+
+fn get_pgo_use_path(config: &ModuleConfig) -> Option<CString> {
+    config.pgo_use.as_ref().map(|path_buf| {
+        CString::new(path_buf.to_string_lossy().as_bytes()).unwrap()
+    })
+}
+
 pub unsafe fn with_llvm_pmb(llmod: &llvm::Module,
                             config: &ModuleConfig,
                             opt_level: llvm::CodeGenOptLevel,
@@ -716,24 +899,8 @@ pub unsafe fn with_llvm_pmb(llmod: &llvm::Module,
         .unwrap_or(llvm::CodeGenOptSizeNone);
     let inline_threshold = config.inline_threshold;
 
-    let pgo_gen_path = match config.pgo_gen {
-        SwitchWithOptPath::Enabled(ref opt_dir_path) => {
-            let path = if let Some(dir_path) = opt_dir_path {
-                dir_path.join("default_%m.profraw")
-            } else {
-                PathBuf::from("default_%m.profraw")
-            };
-
-            Some(CString::new(format!("{}", path.display())).unwrap())
-        }
-        SwitchWithOptPath::Disabled => {
-            None
-        }
-    };
-
-    let pgo_use_path = config.pgo_use.as_ref().map(|path_buf| {
-        CString::new(path_buf.to_string_lossy().as_bytes()).unwrap()
-    });
+    let pgo_gen_path = get_pgo_gen_path(config);
+    let pgo_use_path = get_pgo_use_path(config);
 
     llvm::LLVMRustConfigurePassManagerBuilder(
         builder,
@@ -172,13 +172,19 @@ impl WriteBackendMethods for LlvmCodegenBackend {
         module: &ModuleCodegen<Self::Module>,
         config: &ModuleConfig,
     ) -> Result<(), FatalError> {
-        back::write::optimize(cgcx, diag_handler, module, config)
+        back::write::with_llvm_instrumentation(cgcx, diag_handler, &module.name, "optimize", || {
+            back::write::optimize(cgcx, diag_handler, module, config)
+        })
     }
     unsafe fn optimize_thin(
         cgcx: &CodegenContext<Self>,
         thin: &mut ThinModule<Self>,
     ) -> Result<ModuleCodegen<Self::Module>, FatalError> {
-        back::lto::optimize_thin_module(thin, cgcx)
+        let diag_handler = cgcx.create_diag_handler();
+        let name = thin.name().to_string();
+        back::write::with_llvm_instrumentation(cgcx, &diag_handler, &name, "thin-lto", || {
+            back::lto::optimize_thin_module(thin, cgcx)
+        })
     }
     unsafe fn codegen(
         cgcx: &CodegenContext<Self>,
@@ -186,7 +192,10 @@ impl WriteBackendMethods for LlvmCodegenBackend {
         module: ModuleCodegen<Self::Module>,
         config: &ModuleConfig,
     ) -> Result<CompiledModule, FatalError> {
-        back::write::codegen(cgcx, diag_handler, module, config)
+        let name = module.name.clone();
+        back::write::with_llvm_instrumentation(cgcx, diag_handler, &name, "codegen", || {
+            back::write::codegen(cgcx, diag_handler, module, config)
+        })
     }
     fn prepare_thin(
         module: ModuleCodegen<Self::Module>
@@ -203,8 +212,11 @@ impl WriteBackendMethods for LlvmCodegenBackend {
         module: &ModuleCodegen<Self::Module>,
         config: &ModuleConfig,
         thin: bool
-    ) {
-        back::lto::run_pass_manager(cgcx, module, config, thin)
+    ) -> Result<(), FatalError> {
+        let diag_handler = cgcx.create_diag_handler();
+        back::write::with_llvm_instrumentation(cgcx, &diag_handler, &module.name, "lto", || {
+            back::lto::run_pass_manager(cgcx, module, config, thin)
+        })
     }
 }
 
@@ -306,6 +318,9 @@ impl CodegenBackend for LlvmCodegenBackend {
                 <rustc_codegen_ssa::back::write::OngoingCodegen<LlvmCodegenBackend>>()
                 .expect("Expected LlvmCodegenBackend's OngoingCodegen, found Box<Any>")
                 .join(sess);
+        if let Some(ref path) = sess.opts.debugging_opts.llvm_time_trace {
+            llvm_util::write_time_trace(sess, path);
+        }
         if sess.opts.debugging_opts.incremental_info {
             rustc_codegen_ssa::back::write::dump_incremental_data(&codegen_results);
         }
@@ -19,6 +19,21 @@ pub struct Child<'a> {
     pub raw: &'a mut super::ArchiveChild<'a>,
 }
 
+/// A member of an archive, as listed by `ArchiveRO::members`.
+pub struct Member<'a> {
+    name: &'a [u8],
+    data: &'a [u8],
+}
+
+fn member<'a>(info: &super::ArchiveMemberInfo, data: &'a [u8]) -> Member<'a> {
+    unsafe {
+        Member {
+            name: slice::from_raw_parts(info.name as *const u8, info.name_len),
+            data: &data[info.offset..info.offset + info.size],
+        }
+    }
+}
+
 impl ArchiveRO {
     /// Opens a static archive for read-only purposes. This is more optimized
     /// than the `open` method because it uses LLVM's internal `Archive` class
@@ -36,6 +51,65 @@ impl ArchiveRO {
         };
     }
 
+    /// Returns all members of the archive, in order.
+    ///
+    /// The members are listed in a single call from an index built when the
+    /// archive was opened. Archives that couldn't be indexed, such as thin
+    /// archives, are walked with `iter` instead, skipping any members that
+    /// can't be read.
+    pub fn members(&self) -> Vec<Member<'_>> {
+        match self.index() {
+            Some((index, data)) => index.iter().map(|info| member(info, data)).collect(),
+            None => {
+                self.iter().filter_map(|child| {
+                    let child = child.ok()?;
+                    Some(Member { name: child.name()?.as_bytes(), data: child.data() })
+                }).collect()
+            }
+        }
+    }
+
+    /// Returns the data of the first member called `name`, if there is one.
+    ///
+    /// This is a hash table lookup, unless the archive couldn't be indexed.
+    pub fn member_data(&self, name: &str) -> Option<&[u8]> {
+        let data = match self.index() {
+            Some((_, data)) => data,
+            None => {
+                return self.iter()
+                    .filter_map(|child| child.ok())
+                    .find(|child| child.name() == Some(name))
+                    .map(|child| child.data());
+            }
+        };
+        unsafe {
+            super::LLVMRustArchiveFindMember(self.raw,
+                                             name.as_ptr() as *const _,
+                                             name.len())
+                .map(|info| member(info, data).data)
+        }
+    }
+
+    /// Returns the index of the archive's members along with the buffer their
+    /// data is in.
+    fn index(&self) -> Option<(&[super::ArchiveMemberInfo], &[u8])> {
+        unsafe {
+            let mut len = 0;
+            let ptr = super::LLVMRustArchiveMembers(self.raw, &mut len);
+            if ptr.is_null() {
+                // Nobody cares why the archive couldn't be indexed, `iter` will
+                // report any problems with its members.
+                super::last_error();
+                return None;
+            }
+            let index: &[_] = if len == 0 { &[] } else { slice::from_raw_parts(ptr, len) };
+
+            let mut data_len = 0;
+            let data_ptr = super::LLVMRustArchiveData(self.raw, &mut data_len);
+            Some((index, slice::from_raw_parts(data_ptr as *const u8, data_len)))
+        }
+    }
+
     pub fn iter(&self) -> Iter<'_> {
         unsafe {
             Iter {
@@ -83,7 +157,7 @@ impl<'a> Child<'a> {
                 None
             } else {
                 let name = slice::from_raw_parts(name_ptr as *const u8, name_len as usize);
-                str::from_utf8(name).ok().map(|s| s.trim())
+                str::from_utf8(name).ok()
             }
         }
     }
@@ -100,6 +174,16 @@ impl<'a> Child<'a> {
     }
 }
 
+impl<'a> Member<'a> {
+    pub fn name(&self) -> Option<&'a str> {
+        str::from_utf8(self.name).ok()
+    }
+
+    pub fn data(&self) -> &'a [u8] {
+        self.data
+    }
+}
+
 impl<'a> Drop for Child<'a> {
     fn drop(&mut self) {
         unsafe {
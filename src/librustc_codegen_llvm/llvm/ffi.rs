@@ -334,17 +334,6 @@ impl SynchronizationScope {
     }
 }
 
-/// LLVMRustFileType
-#[derive(Copy, Clone)]
-#[repr(C)]
-pub enum FileType {
-    // FIXME: figure out if this variant is needed at all.
-    #[allow(dead_code)]
-    Other,
-    AssemblyFile,
-    ObjectFile,
-}
-
 /// LLVMMetadataType
 #[derive(Copy, Clone)]
 #[repr(C)]
@@ -396,6 +385,35 @@ pub enum CodeGenOptLevel {
     Aggressive,
 }
 
+/// LLVMRustPassBuilderOptLevel
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum PassBuilderOptLevel {
+    // FIXME: figure out if this variant is needed at all.
+    #[allow(dead_code)]
+    Other,
+    O0,
+    O1,
+    O2,
+    O3,
+    Os,
+    Oz,
+}
+
+/// LLVMRustOptStage
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum OptStage {
+    // FIXME: figure out if this variant is needed at all.
+    #[allow(dead_code)]
+    Other,
+    PreLinkNoLTO,
+    PreLinkThinLTO,
+    PreLinkFatLTO,
+    ThinLTO,
+    FatLTO,
+}
+
 /// LLVMRelocMode
 #[derive(Copy, Clone, PartialEq)]
 #[repr(C)]
@@ -454,6 +472,16 @@ pub enum ArchiveKind {
     K_GNU,
     K_BSD,
     K_COFF,
+    K_GNUThin,
+}
+
+/// LLVMRustArchiveMemberInfo
+#[repr(C)]
+pub struct ArchiveMemberInfo {
+    pub name: *const c_char,
+    pub name_len: size_t,
+    pub offset: size_t,
+    pub size: size_t,
 }
 
 /// LLVMRustPassKind
@@ -629,8 +657,12 @@ pub mod debuginfo {
 
 extern { pub type ModuleBuffer; }
 
+/// LLVMRustStatisticsSnapshot
+extern { pub type StatisticsSnapshot; }
+
 extern "C" {
     pub fn LLVMRustInstallFatalErrorHandler();
+    pub fn LLVMRustSetMaxHelperThreads(Threads: c_uint);
 
     // Create and destroy contexts.
     pub fn LLVMRustContextCreate(shouldDiscardNames: bool) -> &'static mut Context;
@@ -1393,6 +1425,20 @@ extern "C" {
     /// Print the pass timings since static dtors aren't picking them up.
     pub fn LLVMRustPrintPassTimings();
 
+    pub fn LLVMRustTimeTraceProfilerInitialize();
+    pub fn LLVMRustTimeTraceProfilerBegin(Name: *const c_char, Detail: *const c_char);
+    pub fn LLVMRustTimeTraceProfilerEnd();
+    pub fn LLVMRustTimeTraceProfilerFinish(Path: *const c_char) -> LLVMRustResult;
+
+    pub fn LLVMRustEnableStatistics();
+    pub fn LLVMRustStatisticsSnapshotCreate() -> Option<&'static mut StatisticsSnapshot>;
+    pub fn LLVMRustStatisticsSnapshotFree(S: &'static mut StatisticsSnapshot);
+    pub fn LLVMRustStatisticsSnapshotDiff(Before: &StatisticsSnapshot,
+                                          ModuleName: *const c_char,
+                                          Phase: *const c_char,
+                                          s: &RustString)
+                                          -> LLVMRustResult;
+
     pub fn LLVMStructCreateNamed(C: &Context, Name: *const c_char) -> &Type;
 
     pub fn LLVMStructSetBody(StructTy: &'a Type,
@@ -1693,6 +1739,21 @@ extern "C" {
                                        AsmComments: bool,
                                        EmitStackSizeSection: bool)
                                        -> Option<&'static mut TargetMachine>;
+    pub fn LLVMRustGetCachedTargetMachine(Triple: *const c_char,
+                                          CPU: *const c_char,
+                                          Features: *const c_char,
+                                          Model: CodeModel,
+                                          Reloc: RelocMode,
+                                          Level: CodeGenOptLevel,
+                                          UseSoftFP: bool,
+                                          PositionIndependentExecutable: bool,
+                                          FunctionSections: bool,
+                                          DataSections: bool,
+                                          TrapUnreachable: bool,
+                                          Singlethread: bool,
+                                          AsmComments: bool,
+                                          EmitStackSizeSection: bool)
+                                          -> Option<&'static mut TargetMachine>;
     pub fn LLVMRustDisposeTargetMachine(T: &'static mut TargetMachine);
     pub fn LLVMRustAddAnalysisPasses(T: &'a TargetMachine, PM: &PassManager<'a>, M: &'a Module);
     pub fn LLVMRustAddBuilderLibraryInfo(PMB: &'a PassManagerBuilder,
@@ -1710,20 +1771,35 @@ extern "C" {
                                   M: &'a Module,
                                   DisableSimplifyLibCalls: bool);
     pub fn LLVMRustRunFunctionPassManager(PM: &PassManager<'a>, M: &'a Module);
-    pub fn LLVMRustWriteOutputFile(T: &'a TargetMachine,
-                                   PM: &PassManager<'a>,
-                                   M: &'a Module,
-                                   Output: *const c_char,
-                                   FileType: FileType)
-                                   -> LLVMRustResult;
-    pub fn LLVMRustPrintModule(PM: &PassManager<'a>,
-                               M: &'a Module,
-                               Output: *const c_char,
-                               Demangle: extern fn(*const c_char,
-                                                   size_t,
-                                                   *mut c_char,
-                                                   size_t) -> size_t,
-                               ) -> LLVMRustResult;
+    pub fn LLVMRustOptimizeWithNewPassManager(
+        M: &'a Module,
+        TM: &'a TargetMachine,
+        OptLevel: PassBuilderOptLevel,
+        OptStage: OptStage,
+        NoPrepopulatePasses: bool,
+        VerifyIR: bool,
+        UseThinLTOBuffers: bool,
+        MergeFunctions: bool,
+        UnrollLoops: bool,
+        SLPVectorize: bool,
+        LoopVectorize: bool,
+        DisableSimplifyLibCalls: bool,
+        PGOGenPath: *const c_char,
+        PGOUsePath: *const c_char,
+        ExtraPasses: *const *const c_char,
+        NumExtraPasses: size_t,
+    ) -> LLVMRustResult;
+    pub fn LLVMRustWriteOutputFiles(T: &'a TargetMachine,
+                                    M: &'a Module,
+                                    IROutput: *const c_char,
+                                    AsmOutput: *const c_char,
+                                    ObjOutput: *const c_char,
+                                    DisableSimplifyLibCalls: bool,
+                                    Demangle: extern fn(*const c_char,
+                                                        size_t,
+                                                        *mut c_char,
+                                                        size_t) -> size_t,
+                                    ) -> LLVMRustResult;
     pub fn LLVMRustSetLLVMOptions(Argc: c_int, Argv: *const *const c_char);
     pub fn LLVMRustPrintPasses();
     pub fn LLVMRustSetNormalizedTarget(M: &Module, triple: *const c_char);
@@ -1732,6 +1808,16 @@ extern "C" {
     pub fn LLVMRustMarkAllFunctionsNounwind(M: &Module);
 
     pub fn LLVMRustOpenArchive(path: *const c_char) -> Option<&'static mut Archive>;
+    pub fn LLVMRustArchiveData(AR: &Archive, size: &mut size_t) -> *const c_char;
+    pub fn LLVMRustArchiveMembers(
+        AR: &'a Archive,
+        num_members: &mut size_t,
+    ) -> *const ArchiveMemberInfo;
+    pub fn LLVMRustArchiveFindMember(
+        AR: &'a Archive,
+        name: *const c_char,
+        name_len: size_t,
+    ) -> Option<&'a ArchiveMemberInfo>;
     pub fn LLVMRustArchiveIteratorNew(AR: &'a Archive) -> &'a mut ArchiveIterator<'a>;
     pub fn LLVMRustArchiveIteratorNext(
         AIR: &ArchiveIterator<'a>,
@@ -1782,8 +1868,19 @@ extern "C" {
                                 NumMembers: size_t,
                                 Members: *const &RustArchiveMember<'_>,
                                 WriteSymbtab: bool,
+                                ReuseSymbols: bool,
                                 Kind: ArchiveKind)
                                 -> LLVMRustResult;
+    pub fn LLVMRustUpdateArchive(Dst: *const c_char,
+                                 Src: &Archive,
+                                 NumRemovals: size_t,
+                                 Removals: *const *const c_char,
+                                 NumMembers: size_t,
+                                 Members: *const &RustArchiveMember<'_>,
+                                 WriteSymbtab: bool,
+                                 ReuseSymbols: bool,
+                                 Kind: ArchiveKind)
+                                 -> LLVMRustResult;
     pub fn LLVMRustArchiveMemberNew(Filename: *const c_char,
                                     Name: *const c_char,
                                     Child: Option<&ArchiveChild<'a>>)
@@ -1840,12 +1937,18 @@ extern "C" {
         ModuleNameCallback: ThinLTOModuleNameCallback,
         CallbackPayload: *mut c_void,
     );
+    pub fn LLVMRustComputeLTOCacheKey(
+        KeyOut: &RustString,
+        ModId: *const c_char,
+        Data: &ThinLTOData,
+    ) -> LLVMRustResult;
     pub fn LLVMRustFreeThinLTOData(Data: &'static mut ThinLTOData);
     pub fn LLVMRustParseBitcodeForLTO(
         Context: &Context,
         Data: *const u8,
         len: usize,
         Identifier: *const c_char,
+        ThinData: Option<&ThinLTOData>,
     ) -> Option<&Module>;
     pub fn LLVMRustThinLTOGetDICompileUnit(M: &Module,
                                            CU1: &mut *mut c_void,
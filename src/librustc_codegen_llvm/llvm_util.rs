@@ -2,13 +2,16 @@ use crate::back::write::create_informational_target_machine;
 use crate::llvm;
 use syntax_pos::symbol::Symbol;
 use rustc::session::Session;
-use rustc::session::config::PrintRequest;
+use rustc::session::config::{self, PrintRequest};
 use rustc_target::spec::MergeFunctions;
-use libc::c_int;
+use rustc_fs_util::path_to_c_string;
+use libc::{c_int, c_uint};
 use std::ffi::CString;
 use syntax::feature_gate::UnstableFeatures;
 use syntax::symbol::sym;
 
+use std::cmp;
+use std::path::Path;
 use std::str;
 use std::slice;
 use std::sync::atomic::{AtomicBool, Ordering};
@@ -43,6 +46,17 @@ fn require_inited() {
     }
 }
 
+/// The number of threads, including the calling one, that a single piece of
+/// LLVM work may use. Helper threads aren't accounted for by the jobserver, so
+/// they are only used when asked for explicitly with `-Z llvm-helper-threads`.
+pub(crate) fn max_helper_threads(opts: &config::Options) -> usize {
+    if opts.debugging_opts.no_parallel_llvm {
+        1
+    } else {
+        cmp::max(opts.debugging_opts.llvm_helper_threads.unwrap_or(1), 1)
+    }
+}
+
 unsafe fn configure_llvm(sess: &Session) {
     let n_args = sess.opts.cg.llvm_args.len();
     let mut llvm_c_strs = Vec::with_capacity(n_args + 1);
@@ -50,6 +64,8 @@ unsafe fn configure_llvm(sess: &Session) {
 
     llvm::LLVMRustInstallFatalErrorHandler();
 
+    llvm::LLVMRustSetMaxHelperThreads(max_helper_threads(&sess.opts) as c_uint);
+
     {
         let mut add = |arg: &str| {
             let s = CString::new(arg).unwrap();
@@ -57,7 +73,9 @@ unsafe fn configure_llvm(sess: &Session) {
             llvm_c_strs.push(s);
         };
         add("rustc"); // fake program name
-        if sess.time_llvm_passes() { add("-time-passes"); }
+        if sess.time_llvm_passes() || sess.opts.debugging_opts.llvm_stats_json.is_some() {
+            add("-time-passes");
+        }
         if sess.print_llvm_passes() { add("-debug-pass=Structure"); }
         if sess.opts.debugging_opts.disable_instrumentation_preinliner {
             add("-disable-preinline");
@@ -77,6 +95,31 @@ unsafe fn configure_llvm(sess: &Session) {
         // during inlining. Unfortunately these may block other optimizations.
         add("-preserve-alignment-assumptions-during-inlining=false");
 
+        // How eagerly ThinLTO imports functions. These are process-wide LLVM
+        // options, not per-module settings. LLVM rejects options that are
+        // given more than once, so these give way to the same option passed
+        // through `-C llvm-args`. The limits are `unsigned` and `int` options
+        // in LLVM, so larger values are clamped to what those can hold.
+        let dopts = &sess.opts.debugging_opts;
+        let instr_limit = dopts.thinlto_import_instr_limit
+            .map(|v| cmp::min(v, u32::max_value() as usize).to_string());
+        let cutoff = dopts.thinlto_import_cutoff
+            .map(|v| cmp::min(v, i32::max_value() as usize).to_string());
+        let import_options = [
+            ("import-instr-limit", instr_limit),
+            ("import-cutoff", cutoff),
+            ("import-hot-multiplier", dopts.thinlto_import_hot_multiplier.clone()),
+            ("import-cold-multiplier", dopts.thinlto_import_cold_multiplier.clone()),
+        ];
+        for (name, value) in import_options.iter() {
+            let user_specified = sess.opts.cg.llvm_args.iter().any(|arg| {
+                arg.trim_start_matches('-').split('=').next() == Some(*name)
+            });
+            if let (Some(value), false) = (value, user_specified) {
+                add(&format!("-{}={}", name, value));
+            }
+        }
+
         for arg in &sess.opts.cg.llvm_args {
             add(&(*arg));
         }
@@ -88,6 +131,42 @@ unsafe fn configure_llvm(sess: &Session) {
 
     llvm::LLVMRustSetLLVMOptions(llvm_args.len() as c_int,
                                  llvm_args.as_ptr());
+
+    if sess.opts.debugging_opts.llvm_stats_json.is_some() {
+        llvm::LLVMRustEnableStatistics();
+    }
+
+    if sess.opts.debugging_opts.llvm_time_trace.is_some() && time_trace_supported(sess) {
+        llvm::LLVMRustTimeTraceProfilerInitialize();
+    }
+}
+
+// The time-trace profiler of LLVM 9 isn't thread-safe, so it can only be used
+// when codegen units are processed one at a time.
+fn time_trace_supported(sess: &Session) -> bool {
+    if get_major_version() < 9 {
+        sess.warn("`-Z llvm-time-trace` requires LLVM 9 or later");
+        false
+    } else if !sess.opts.debugging_opts.no_parallel_llvm {
+        sess.err("`-Z llvm-time-trace` requires `-Z no-parallel-llvm`");
+        false
+    } else {
+        true
+    }
+}
+
+/// Writes the events recorded by LLVM's time-trace profiler for all codegen
+/// units to `path` as a Chrome trace.
+pub fn write_time_trace(sess: &Session, path: &Path) {
+    if get_major_version() < 9 || !sess.opts.debugging_opts.no_parallel_llvm {
+        return;
+    }
+    let path_c = path_to_c_string(path);
+    let result = unsafe { llvm::LLVMRustTimeTraceProfilerFinish(path_c.as_ptr()) };
+    if result.into_result().is_err() {
+        let msg = llvm::last_error().unwrap_or_else(|| "unknown error".to_string());
+        sess.err(&format!("failed to write LLVM time trace to {}: {}", path.display(), msg));
+    }
 }
 
 // WARNING: the features after applying `to_llvm_feature` must be known
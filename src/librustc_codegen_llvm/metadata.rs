@@ -28,10 +28,7 @@ impl MetadataLoader for LlvmMetadataLoader {
             })?;
         let buf: OwningRef<_, [u8]> = archive
             .try_map(|ar| {
-                ar.iter()
-                    .filter_map(|s| s.ok())
-                    .find(|sect| sect.name() == Some(METADATA_FILENAME))
-                    .map(|s| s.data())
+                ar.member_data(METADATA_FILENAME)
                     .ok_or_else(|| {
                         debug!("didn't find '{}' in the archive", METADATA_FILENAME);
                         format!("failed to read rlib metadata: '{}'",
@@ -1,7 +1,14 @@
+#include <map>
+
 #include "rustllvm.h"
 
+#include "llvm/ADT/StringSet.h"
+#include "llvm/BinaryFormat/Magic.h"
 #include "llvm/Object/Archive.h"
 #include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Object/SymbolicFile.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Path.h"
 
 using namespace llvm;
@@ -39,11 +46,14 @@ enum class LLVMRustArchiveKind {
   GNU,
   BSD,
   COFF,
+  // A GNU archive which only references its members by their paths.
+  GNUThin,
 };
 
 static Archive::Kind fromRust(LLVMRustArchiveKind Kind) {
   switch (Kind) {
   case LLVMRustArchiveKind::GNU:
+  case LLVMRustArchiveKind::GNUThin:
     return Archive::K_GNU;
   case LLVMRustArchiveKind::BSD:
     return Archive::K_BSD;
@@ -54,12 +64,88 @@ static Archive::Kind fromRust(LLVMRustArchiveKind Kind) {
   }
 }
 
-typedef OwningBinary<Archive> *LLVMRustArchiveRef;
+// Describes a member of an archive, see `LLVMRustArchiveMembers`. The data of
+// the member is `size` bytes at `offset` in the archive's buffer, see
+// `LLVMRustArchiveData`.
+struct LLVMRustArchiveMemberInfo {
+  const char *name;
+  size_t name_len;
+  size_t offset;
+  size_t size;
+};
+
+// An opened archive, along with an index of its members that is built once
+// when it's opened. This allows looking members up by name, or listing all of
+// them, without walking the archive's headers and allocating a child for each
+// member every time.
+struct RustArchive {
+  OwningBinary<Archive> Binary;
+  std::vector<LLVMRustArchiveMemberInfo> Members;
+  // Maps the name of each member to its position in `Members`, the first
+  // member wins if there are several with the same name.
+  StringMap<size_t> MemberIndex;
+  // If the index couldn't be built, why not. Only the iterator can be used for
+  // such archives.
+  std::string IndexError;
+
+  RustArchive(OwningBinary<Archive> Binary) : Binary(std::move(Binary)) {}
+};
+
+typedef RustArchive *LLVMRustArchiveRef;
 typedef RustArchiveMember *LLVMRustArchiveMemberRef;
 typedef Archive::Child *LLVMRustArchiveChildRef;
 typedef Archive::Child const *LLVMRustArchiveChildConstRef;
 typedef RustArchiveIterator *LLVMRustArchiveIteratorRef;
 
+// Returns the name of `Child` as rustc sees it: without any padding and, for
+// members of thin archives, which are named by their path relative to the
+// archive, just the name of the file they refer to like for any other archive.
+static Expected<StringRef> getMemberName(const Archive::Child &Child) {
+  Expected<StringRef> NameOrErr = Child.getName();
+  if (!NameOrErr)
+    return NameOrErr.takeError();
+  StringRef Name = NameOrErr->trim();
+  if (Child.getParent()->isThin())
+    Name = sys::path::filename(Name);
+  return Name;
+}
+
+static void buildMemberIndex(RustArchive &RA) {
+  Archive *Ar = RA.Binary.getBinary();
+  // The data of the members of thin archives isn't in the archive at all.
+  if (Ar->isThin()) {
+    RA.IndexError = "thin archives aren't indexed";
+    return;
+  }
+
+  StringRef Data = Ar->getData();
+  Error Err = Error::success();
+  for (const Archive::Child &Child : Ar->children(Err)) {
+    Expected<StringRef> NameOrErr = getMemberName(Child);
+    if (!NameOrErr) {
+      RA.IndexError = toString(NameOrErr.takeError());
+      break;
+    }
+    Expected<StringRef> BufOrErr = Child.getBuffer();
+    if (!BufOrErr) {
+      RA.IndexError = toString(BufOrErr.takeError());
+      break;
+    }
+    StringRef Name = *NameOrErr;
+    RA.MemberIndex.insert(std::make_pair(Name, RA.Members.size()));
+    RA.Members.push_back({Name.data(), Name.size(),
+                          size_t(BufOrErr->data() - Data.data()),
+                          BufOrErr->size()});
+  }
+  if (Err)
+    RA.IndexError = toString(std::move(Err));
+
+  if (!RA.IndexError.empty()) {
+    RA.Members.clear();
+    RA.MemberIndex.clear();
+  }
+}
+
 extern "C" LLVMRustArchiveRef LLVMRustOpenArchive(char *Path) {
   ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
       MemoryBuffer::getFile(Path, -1, false);
@@ -76,8 +162,9 @@ extern "C" LLVMRustArchiveRef LLVMRustOpenArchive(char *Path) {
     return nullptr;
   }
 
-  OwningBinary<Archive> *Ret = new OwningBinary<Archive>(
-      std::move(ArchiveOr.get()), std::move(BufOr.get()));
+  RustArchive *Ret = new RustArchive(OwningBinary<Archive>(
+      std::move(ArchiveOr.get()), std::move(BufOr.get())));
+  buildMemberIndex(*Ret);
 
   return Ret;
 }
@@ -86,9 +173,41 @@ extern "C" void LLVMRustDestroyArchive(LLVMRustArchiveRef RustArchive) {
   delete RustArchive;
 }
 
+// Returns the buffer the archive was read from, which holds the data of all of
+// its members.
+extern "C" const char *LLVMRustArchiveData(LLVMRustArchiveRef RustArchive,
+                                           size_t *Size) {
+  StringRef Data = RustArchive->Binary.getBinary()->getData();
+  *Size = Data.size();
+  return Data.data();
+}
+
+// Returns all members of the archive, in the order they appear in, in one go.
+// Returns null if the archive couldn't be indexed.
+extern "C" const LLVMRustArchiveMemberInfo *
+LLVMRustArchiveMembers(LLVMRustArchiveRef RustArchive, size_t *NumMembers) {
+  if (!RustArchive->IndexError.empty()) {
+    LLVMRustSetLastError(RustArchive->IndexError.c_str());
+    return nullptr;
+  }
+  *NumMembers = RustArchive->Members.size();
+  return RustArchive->Members.data();
+}
+
+// Looks up the (first) member called `Name`. Returns null if there is none, or
+// if the archive couldn't be indexed.
+extern "C" const LLVMRustArchiveMemberInfo *
+LLVMRustArchiveFindMember(LLVMRustArchiveRef RustArchive, const char *Name,
+                          size_t NameLen) {
+  auto It = RustArchive->MemberIndex.find(StringRef(Name, NameLen));
+  if (It == RustArchive->MemberIndex.end())
+    return nullptr;
+  return &RustArchive->Members[It->second];
+}
+
 extern "C" LLVMRustArchiveIteratorRef
 LLVMRustArchiveIteratorNew(LLVMRustArchiveRef RustArchive) {
-  Archive *Archive = RustArchive->getBinary();
+  Archive *Archive = RustArchive->Binary.getBinary();
   std::unique_ptr<Error> Err = llvm::make_unique<Error>(Error::success());
   auto Cur = Archive->child_begin(*Err);
   if (*Err) {
@@ -139,7 +258,7 @@ extern "C" void LLVMRustArchiveIteratorFree(LLVMRustArchiveIteratorRef RAI) {
 
 extern "C" const char *
 LLVMRustArchiveChildName(LLVMRustArchiveChildConstRef Child, size_t *Size) {
-  Expected<StringRef> NameOrErr = Child->getName();
+  Expected<StringRef> NameOrErr = getMemberName(*Child);
   if (!NameOrErr) {
     // rustc_codegen_llvm currently doesn't use this error string, but it might be
     // useful in the future, and in the mean time this tells LLVM that the
@@ -180,41 +299,623 @@ extern "C" void LLVMRustArchiveMemberFree(LLVMRustArchiveMemberRef Member) {
   delete Member;
 }
 
-extern "C" LLVMRustResult
-LLVMRustWriteArchive(char *Dst, size_t NumMembers,
-                     const LLVMRustArchiveMemberRef *NewMembers,
-                     bool WriteSymbtab, LLVMRustArchiveKind RustKind) {
+// Returns the names which `writeArchive` puts into the symbol table for a
+// member with the contents `Buf`. Members which aren't objects have none.
+static Expected<std::vector<std::string>>
+getArchiveSymbols(MemoryBufferRef Buf, LLVMContext &Context) {
+  std::vector<std::string> Symbols;
+  Expected<std::unique_ptr<SymbolicFile>> ObjOrErr =
+      SymbolicFile::createSymbolicFile(Buf, file_magic::unknown, &Context);
+  if (!ObjOrErr) {
+    consumeError(ObjOrErr.takeError());
+    return Symbols;
+  }
 
+  for (const BasicSymbolRef &S : (*ObjOrErr)->symbols()) {
+    uint32_t Flags = S.getFlags();
+    if ((Flags & BasicSymbolRef::SF_FormatSpecific) ||
+        !(Flags & BasicSymbolRef::SF_Global) ||
+        (Flags & BasicSymbolRef::SF_Undefined))
+      continue;
+    std::string Name;
+    raw_string_ostream OS(Name);
+    if (std::error_code EC = S.printName(OS))
+      return errorCodeToError(EC);
+    Symbols.push_back(OS.str());
+  }
+  return Symbols;
+}
+
+// The size of the header of each member of a GNU archive.
+static const uint64_t GNUHeaderSize = 60;
+
+// Reads the symbol table of the GNU archive `Ar` as pairs of the offset of the
+// header of a member and the name of a symbol defined by it. Returns `false`
+// if `Ar` doesn't have a symbol table this can read.
+static bool
+readGNUSymbolTable(const Archive &Ar,
+                   std::vector<std::pair<uint64_t, StringRef>> &Symbols) {
+  if (Ar.kind() != Archive::K_GNU || Ar.isThin() || !Ar.hasSymbolTable())
+    return false;
+
+  StringRef Table = Ar.getSymbolTable();
+  if (Table.size() < 4)
+    return false;
+  uint32_t NumSymbols = support::endian::read32be(Table.data());
+  if (Table.size() < 4 + uint64_t(NumSymbols) * 4)
+    return false;
+  StringRef Names = Table.drop_front(4 + uint64_t(NumSymbols) * 4);
+  for (uint32_t I = 0; I < NumSymbols; I++) {
+    uint32_t Offset = support::endian::read32be(Table.data() + 4 + I * 4);
+    size_t NameLen = Names.find('\0');
+    if (NameLen == StringRef::npos)
+      return false;
+    Symbols.push_back(std::make_pair(Offset, Names.take_front(NameLen)));
+    Names = Names.drop_front(NameLen + 1);
+  }
+  return true;
+}
+
+// The symbols of the members of GNU archives, as recorded in the symbol tables
+// of those archives. Members which are copied from such an archive don't have
+// to be parsed again to build the symbol table of the new archive, which is
+// most of the members of a staticlib: they come from the rlibs of the standard
+// library and of all other dependencies. Members which aren't listed in the
+// table are still parsed, as its writer might have missed symbols of them.
+class SourceSymbolTables {
+  typedef DenseMap<uint64_t, std::vector<StringRef>> SymbolTable;
+  // The symbols of each member by the offset of its header, or null if the
+  // symbol table of an archive can't be used.
+  std::map<const Archive *, std::unique_ptr<SymbolTable>> Tables;
+
+public:
+  void add(const Archive *Ar) {
+    if (Tables.count(Ar))
+      return;
+    std::unique_ptr<SymbolTable> &Table = Tables[Ar];
+
+    std::vector<std::pair<uint64_t, StringRef>> Symbols;
+    if (!readGNUSymbolTable(*Ar, Symbols))
+      return;
+
+    // Only trust a symbol table which refers to actual members.
+    DenseSet<uint64_t> MemberOffsets;
+    bool Complete = true;
+    Error Err = Error::success();
+    for (const Archive::Child &Child : Ar->children(Err)) {
+      Expected<StringRef> BufOrErr = Child.getBuffer();
+      if (!BufOrErr) {
+        consumeError(BufOrErr.takeError());
+        Complete = false;
+        break;
+      }
+      MemberOffsets.insert(BufOrErr->data() - Ar->getData().data() -
+                           GNUHeaderSize);
+    }
+    if (Err) {
+      consumeError(std::move(Err));
+      return;
+    }
+    if (!Complete)
+      return;
+
+    auto NewTable = llvm::make_unique<SymbolTable>();
+    for (auto &Symbol : Symbols) {
+      if (!MemberOffsets.count(Symbol.first))
+        return;
+      (*NewTable)[Symbol.first].push_back(Symbol.second);
+    }
+    Table = std::move(NewTable);
+  }
+
+  // Looks up the symbols of `Child`, returns `false` if they aren't known.
+  // Symbols are only known for members which are listed in the table.
+  bool lookup(const Archive::Child &Child,
+              std::vector<std::string> &Symbols) const {
+    auto It = Tables.find(Child.getParent());
+    if (It == Tables.end() || !It->second)
+      return false;
+    Expected<StringRef> BufOrErr = Child.getBuffer();
+    if (!BufOrErr) {
+      consumeError(BufOrErr.takeError());
+      return false;
+    }
+
+    uint64_t Offset =
+        BufOrErr->data() - Child.getParent()->getData().data() - GNUHeaderSize;
+    auto SymbolsIt = It->second->find(Offset);
+    if (SymbolsIt == It->second->end())
+      return false;
+    for (StringRef Symbol : SymbolsIt->second)
+      Symbols.push_back(Symbol.str());
+    return true;
+  }
+};
+
+// Members read by `loadArchiveMembers`.
+struct LoadedMembers {
   std::vector<NewArchiveMember> Members;
-  auto Kind = fromRust(RustKind);
+  // The symbols of each member, if they were collected.
+  bool HasSymbols = false;
+  std::vector<std::vector<std::string>> Symbols;
+  // The names of the members of thin archives, which `Members` refer to.
+  std::vector<std::string> Paths;
+};
 
+// Reads `NumMembers` members into `Loaded`. Returns `false` after setting the
+// last error if any of them couldn't be read.
+//
+// The members of a thin archive at `ThinArchive` are named by their path
+// relative to it instead of their file name, and have to be files. If
+// `CollectSymbols` is set, the symbols of each member are collected as well.
+static bool loadArchiveMembers(size_t NumMembers,
+                               const LLVMRustArchiveMemberRef *NewMembers,
+                               LoadedMembers &Loaded, const char *ThinArchive,
+                               bool CollectSymbols) {
+  std::vector<NewArchiveMember> &Members = Loaded.Members;
+  std::vector<std::vector<std::string>> &Symbols = Loaded.Symbols;
+  Members.resize(NumMembers);
+  Loaded.Paths.resize(NumMembers);
+  std::vector<std::string> Errors(NumMembers);
+
+  SourceSymbolTables SourceSymbols;
+  Loaded.HasSymbols = CollectSymbols;
+  if (CollectSymbols)
+    Symbols.resize(NumMembers);
+  // Reading a child of a thin archive opens the file it references and caches
+  // it in the archive, which isn't safe to do from several threads at once.
+  bool HasThinSources = false;
   for (size_t I = 0; I < NumMembers; I++) {
-    auto Member = NewMembers[I];
-    assert(Member->Name);
-    if (Member->Filename) {
-      Expected<NewArchiveMember> MOrErr =
-          NewArchiveMember::getFile(Member->Filename, true);
-      if (!MOrErr) {
-        LLVMRustSetLastError(toString(MOrErr.takeError()).c_str());
-        return LLVMRustResult::Failure;
+    if (NewMembers[I]->Filename)
+      continue;
+    const Archive *Parent = NewMembers[I]->Child.getParent();
+    HasThinSources |= Parent->isThin();
+    if (CollectSymbols)
+      SourceSymbols.add(Parent);
+  }
+
+  // Reading the members is independent per member and dominates for
+  // staticlibs with thousands of objects, so it is spread over a thread pool,
+  // along with parsing the members whose symbols aren't known yet. Every slot
+  // is filled in place, so the members and therefore the output keep their
+  // order.
+  auto LoadRange = [&](size_t Begin, size_t End) {
+    // Bitcode is parsed into a context, which can't be shared across threads.
+    LLVMContext Context;
+    for (size_t I = Begin; I < End; I++) {
+      auto Member = NewMembers[I];
+      assert(Member->Name);
+      if (ThinArchive && !Member->Filename) {
+        Errors[I] = "thin archives can only reference files";
+        continue;
       }
-      MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
-      Members.push_back(std::move(*MOrErr));
-    } else {
       Expected<NewArchiveMember> MOrErr =
-          NewArchiveMember::getOldMember(Member->Child, true);
+          Member->Filename
+              ? NewArchiveMember::getFile(Member->Filename, true)
+              : NewArchiveMember::getOldMember(Member->Child, true);
       if (!MOrErr) {
-        LLVMRustSetLastError(toString(MOrErr.takeError()).c_str());
-        return LLVMRustResult::Failure;
+        Errors[I] = toString(MOrErr.takeError());
+        continue;
+      }
+      if (ThinArchive) {
+        Expected<std::string> PathOrErr =
+            computeArchiveRelativePath(ThinArchive, Member->Filename);
+        if (!PathOrErr) {
+          Errors[I] = toString(PathOrErr.takeError());
+          continue;
+        }
+        Loaded.Paths[I] = std::move(*PathOrErr);
+        MOrErr->MemberName = Loaded.Paths[I];
+      } else if (Member->Filename) {
+        MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
+      }
+
+      if (CollectSymbols &&
+          (Member->Filename ||
+           !SourceSymbols.lookup(Member->Child, Symbols[I]))) {
+        Expected<std::vector<std::string>> SymbolsOrErr =
+            getArchiveSymbols(MOrErr->Buf->getMemBufferRef(), Context);
+        if (!SymbolsOrErr) {
+          Errors[I] = toString(SymbolsOrErr.takeError());
+          continue;
+        }
+        Symbols[I] = std::move(*SymbolsOrErr);
       }
-      Members.push_back(std::move(*MOrErr));
+
+      Members[I] = std::move(*MOrErr);
+    }
+  };
+  if (HasThinSources)
+    LoadRange(0, NumMembers);
+  else
+    parallelForChunks(NumMembers, 64, LoadRange);
+
+  // Report the first failing member, as the serial loop used to.
+  for (const std::string &Error : Errors) {
+    if (!Error.empty()) {
+      LLVMRustSetLastError(Error.c_str());
+      return false;
     }
   }
+  return true;
+}
 
-  auto Result = writeArchive(Dst, Members, WriteSymbtab, Kind, true, false);
+template <typename T>
+static void printWithSpacePadding(raw_ostream &OS, T Data, unsigned Size) {
+  uint64_t OldPos = OS.tell();
+  OS << Data;
+  OS.indent(Size - (OS.tell() - OldPos));
+}
+
+// Prints the header of a member of a GNU archive, as `writeArchive` does.
+static void printGNUMemberHeader(raw_ostream &OS, StringRef Name,
+                                 unsigned ModTime, unsigned UID, unsigned GID,
+                                 unsigned Perms, uint64_t Size) {
+  printWithSpacePadding(OS, Name, 16);
+  printWithSpacePadding(OS, ModTime, 12);
+  printWithSpacePadding(OS, UID % 1000000, 6);
+  printWithSpacePadding(OS, GID % 1000000, 6);
+  printWithSpacePadding(OS, format("%o", Perms), 8);
+  printWithSpacePadding(OS, Size, 10);
+  OS << "`\n";
+}
+
+static void writeBE32(raw_ostream &OS, uint32_t Value) {
+  char Buf[4];
+  support::endian::write32be(Buf, Value);
+  OS.write(Buf, sizeof(Buf));
+}
+
+// A member of an archive written by `writeGNUArchive`.
+struct GNUArchiveMember {
+  // A member copied from another GNU archive: its name, its header after the
+  // name field and its data, which are copied verbatim. Only used if `New` is
+  // null.
+  StringRef Name;
+  StringRef Header;
+  StringRef Data;
+  const NewArchiveMember *New;
+  std::vector<std::string> Symbols;
+};
+
+// Writes a GNU archive with `Members` to `Dst` in the same way as
+// `writeArchive`, except that the symbols of every member are already known.
+//
+// Returns `false` without writing anything if the archive would need a 64-bit
+// symbol table, which is left to `writeArchive`.
+static Expected<bool> writeGNUArchive(StringRef Dst,
+                                      ArrayRef<GNUArchiveMember> Members,
+                                      bool WriteSymtab) {
+  std::string StringTable;
+  StringMap<uint64_t> LongNames;
+  std::vector<std::string> HeaderNames(Members.size());
+  for (size_t I = 0; I < Members.size(); I++) {
+    const NewArchiveMember *New = Members[I].New;
+    StringRef Name = New ? StringRef(New->MemberName) : Members[I].Name;
+    if (Name.size() < 16 && !Name.contains('/')) {
+      HeaderNames[I] = (Name + "/").str();
+      continue;
+    }
+    auto Insertion =
+        LongNames.insert(std::make_pair(Name, uint64_t(StringTable.size())));
+    if (Insertion.second)
+      StringTable += (Name + "/\n").str();
+    HeaderNames[I] = "/" + std::to_string(Insertion.first->second);
+  }
+  if (StringTable.size() % 2)
+    StringTable += '\n';
+
+  uint64_t NumSymbols = 0;
+  uint64_t SymbolTableSize = 4;
+  for (const GNUArchiveMember &M : Members) {
+    NumSymbols += M.Symbols.size();
+    for (const std::string &Symbol : M.Symbols)
+      SymbolTableSize += 4 + Symbol.size() + 1;
+  }
+  SymbolTableSize = alignTo(SymbolTableSize, 2);
+  // Like `writeArchive`, leave out a symbol table without any symbols.
+  WriteSymtab = WriteSymtab && NumSymbols > 0;
+
+  // Lay out the new archive.
+  uint64_t Pos = strlen(ArchiveMagic);
+  if (WriteSymtab)
+    Pos += GNUHeaderSize + SymbolTableSize;
+  if (!StringTable.empty())
+    Pos += GNUHeaderSize + StringTable.size();
+  std::vector<uint64_t> Starts;
+  for (const GNUArchiveMember &M : Members) {
+    Starts.push_back(Pos);
+    Pos += alignTo(GNUHeaderSize + (M.New ? M.New->Buf->getBufferSize()
+                                          : M.Data.size()),
+                   2);
+  }
+  if (WriteSymtab && Pos > UINT32_MAX)
+    return false;
+
+  Expected<sys::fs::TempFile> Temp =
+      sys::fs::TempFile::create(Dst + ".temp-archive-%%%%%%%.a");
+  if (!Temp)
+    return Temp.takeError();
+
+  {
+    raw_fd_ostream Out(Temp->FD, false);
+    Out << ArchiveMagic;
+
+    if (WriteSymtab) {
+      uint64_t Start = Out.tell();
+      printGNUMemberHeader(Out, "/", 0, 0, 0, 0, SymbolTableSize);
+      writeBE32(Out, NumSymbols);
+      for (size_t I = 0; I < Members.size(); I++)
+        for (size_t J = 0; J < Members[I].Symbols.size(); J++)
+          writeBE32(Out, Starts[I]);
+      for (const GNUArchiveMember &M : Members)
+        for (const std::string &Symbol : M.Symbols)
+          Out << Symbol << '\0';
+      while (Out.tell() - Start < GNUHeaderSize + SymbolTableSize)
+        Out << '\0';
+    }
+
+    if (!StringTable.empty()) {
+      printWithSpacePadding(Out, "//", 48);
+      printWithSpacePadding(Out, StringTable.size(), 10);
+      Out << "`\n" << StringTable;
+    }
+
+    for (size_t I = 0; I < Members.size(); I++) {
+      StringRef Buf;
+      if (const NewArchiveMember *M = Members[I].New) {
+        Buf = M->Buf->getBuffer();
+        printGNUMemberHeader(Out, HeaderNames[I], sys::toTimeT(M->ModTime),
+                             M->UID, M->GID, M->Perms, Buf.size());
+      } else {
+        Buf = Members[I].Data;
+        printWithSpacePadding(Out, HeaderNames[I], 16);
+        Out << Members[I].Header;
+      }
+      Out << Buf;
+      if (Buf.size() % 2)
+        Out << '\n';
+    }
+
+    Out.flush();
+    if (Out.has_error()) {
+      std::error_code EC = Out.error();
+      Out.clear_error();
+      consumeError(Temp->discard());
+      return errorCodeToError(EC);
+    }
+  }
+
+  if (Error E = Temp->keep(Dst))
+    return std::move(E);
+  return true;
+}
+
+// Writes the `Loaded` members to `Dst`. If their symbols were collected, GNU
+// archives are written without parsing the members again.
+static LLVMRustResult writeArchiveMembers(StringRef Dst, LoadedMembers &Loaded,
+                                          bool WriteSymbtab,
+                                          LLVMRustArchiveKind RustKind) {
+  std::vector<NewArchiveMember> &Members = Loaded.Members;
+  if (Loaded.HasSymbols && RustKind == LLVMRustArchiveKind::GNU) {
+    std::vector<GNUArchiveMember> GNUMembers;
+    for (size_t I = 0; I < Members.size(); I++)
+      GNUMembers.push_back({StringRef(), StringRef(), StringRef(), &Members[I],
+                            std::move(Loaded.Symbols[I])});
+    Expected<bool> WrittenOrErr =
+        writeGNUArchive(Dst, GNUMembers, WriteSymbtab);
+    if (!WrittenOrErr) {
+      LLVMRustSetLastError(toString(WrittenOrErr.takeError()).c_str());
+      return LLVMRustResult::Failure;
+    }
+    if (*WrittenOrErr)
+      return LLVMRustResult::Success;
+  }
+
+  bool Thin = RustKind == LLVMRustArchiveKind::GNUThin;
+  auto Result = writeArchive(Dst, Members, WriteSymbtab, fromRust(RustKind),
+                             true, Thin);
   if (!Result)
     return LLVMRustResult::Success;
   LLVMRustSetLastError(toString(std::move(Result)).c_str());
 
   return LLVMRustResult::Failure;
 }
+
+// With `ReuseSymbols`, the symbol table of a GNU archive is built from the
+// symbols collected while loading the members, which reuses the symbol tables
+// of the archives members are taken from, instead of by `writeArchive`.
+extern "C" LLVMRustResult
+LLVMRustWriteArchive(char *Dst, size_t NumMembers,
+                     const LLVMRustArchiveMemberRef *NewMembers,
+                     bool WriteSymbtab, bool ReuseSymbols,
+                     LLVMRustArchiveKind RustKind) {
+  bool Thin = RustKind == LLVMRustArchiveKind::GNUThin;
+  bool CollectSymbols =
+      ReuseSymbols && WriteSymbtab && RustKind == LLVMRustArchiveKind::GNU;
+  LoadedMembers Loaded;
+  if (!loadArchiveMembers(NumMembers, NewMembers, Loaded, Thin ? Dst : nullptr,
+                          CollectSymbols))
+    return LLVMRustResult::Failure;
+  return writeArchiveMembers(Dst, Loaded, WriteSymbtab, RustKind);
+}
+
+// Writes the GNU archive `Src` without the members named in `Removals` and
+// with `NewMembers` appended to `Dst`. The members which are kept are copied
+// over with their headers, except for the name field, as the string table is
+// built anew, and their entries in the symbol table of `Src` are reused, so
+// only the new members and the ones missing from that table are parsed. The
+// result has the same layout as a full rewrite would, only the fields of the
+// copied headers keep whatever formatting they had in `Src`.
+//
+// Returns `false` without writing anything if `Src` isn't laid out the way
+// this expects or has members without a valid name, in which case the archive
+// has to be built from scratch.
+static Expected<bool>
+updateGNUArchive(StringRef Dst, const Archive &Src,
+                 const StringSet<> &Removals,
+                 LoadedMembers &NewMembers, bool WriteSymtab) {
+  if (Src.kind() != Archive::K_GNU || Src.isThin())
+    return false;
+  std::vector<std::pair<uint64_t, StringRef>> OldSymbols;
+  if (WriteSymtab && !readGNUSymbolTable(Src, OldSymbols))
+    return false;
+
+  struct OldMember {
+    uint64_t Start;
+    StringRef Name;
+    StringRef Data;
+    bool Keep;
+  };
+  std::vector<OldMember> OldMembers;
+  DenseMap<uint64_t, size_t> OldMemberAt;
+
+  StringRef Data = Src.getData();
+  Error Err = Error::success();
+  for (const Archive::Child &Child : Src.children(Err, false)) {
+    Expected<StringRef> RawNameOrErr = Child.getRawName();
+    if (!RawNameOrErr)
+      return RawNameOrErr.takeError();
+    Expected<StringRef> BufOrErr = Child.getBuffer();
+    if (!BufOrErr)
+      return BufOrErr.takeError();
+    StringRef RawName = *RawNameOrErr;
+
+    // The symbol table was read above, and the string table is rebuilt.
+    // Like `Archive`, only expect them ahead of the other members. 64-bit
+    // symbol tables only appear in archives too big to be worth handling here.
+    if (OldMembers.empty() && (RawName == "/" || RawName == "//"))
+      continue;
+    if (RawName.startswith("/SYM64/"))
+      return false;
+
+    // Members without a name are dropped by the full rewrite.
+    Expected<StringRef> NameOrErr = getMemberName(Child);
+    if (!NameOrErr) {
+      consumeError(NameOrErr.takeError());
+      return false;
+    }
+    uint64_t Start = BufOrErr->data() - Data.data() - GNUHeaderSize;
+    OldMemberAt[Start] = OldMembers.size();
+    OldMembers.push_back(
+        {Start, *NameOrErr, *BufOrErr, !Removals.count(*NameOrErr)});
+  }
+  if (Err)
+    return std::move(Err);
+
+  std::vector<GNUArchiveMember> Members;
+  std::vector<size_t> NewIndex(OldMembers.size());
+  for (size_t I = 0; I < OldMembers.size(); I++) {
+    const OldMember &M = OldMembers[I];
+    if (!M.Keep)
+      continue;
+    NewIndex[I] = Members.size();
+    StringRef Header = Data.slice(M.Start + 16, M.Start + GNUHeaderSize);
+    Members.push_back({M.Name, Header, M.Data, nullptr, {}});
+  }
+
+  std::vector<bool> Listed(OldMembers.size());
+  for (auto &Symbol : OldSymbols) {
+    auto It = OldMemberAt.find(Symbol.first);
+    if (It == OldMemberAt.end())
+      return false;
+    Listed[It->second] = true;
+    if (OldMembers[It->second].Keep)
+      Members[NewIndex[It->second]].Symbols.push_back(Symbol.second.str());
+  }
+  if (WriteSymtab) {
+    LLVMContext Context;
+    for (size_t I = 0; I < OldMembers.size(); I++) {
+      if (!OldMembers[I].Keep || Listed[I])
+        continue;
+      Expected<std::vector<std::string>> SymbolsOrErr = getArchiveSymbols(
+          MemoryBufferRef(OldMembers[I].Data, OldMembers[I].Name), Context);
+      if (!SymbolsOrErr)
+        return SymbolsOrErr.takeError();
+      Members[NewIndex[I]].Symbols = std::move(*SymbolsOrErr);
+    }
+  }
+
+  for (size_t I = 0; I < NewMembers.Members.size(); I++)
+    Members.push_back(
+        {StringRef(), StringRef(), StringRef(), &NewMembers.Members[I],
+         NewMembers.HasSymbols ? NewMembers.Symbols[I]
+                               : std::vector<std::string>()});
+
+  return writeGNUArchive(Dst, Members, WriteSymtab);
+}
+
+// Writes `Src` without the members called one of `Removals` and with
+// `NewMembers` appended to `Dst`, i.e. the same archive as passing all those
+// members to `LLVMRustWriteArchive` would. GNU archives are updated without
+// reading or parsing the members which are kept, unless a symbol table has to
+// be written without `ReuseSymbols`; anything else is rewritten.
+extern "C" LLVMRustResult
+LLVMRustUpdateArchive(char *Dst, LLVMRustArchiveRef RustArchive,
+                      size_t NumRemovals, const char *const *Removals,
+                      size_t NumMembers,
+                      const LLVMRustArchiveMemberRef *NewMembers,
+                      bool WriteSymbtab, bool ReuseSymbols,
+                      LLVMRustArchiveKind RustKind) {
+  const Archive &Src = *RustArchive->Binary.getBinary();
+  bool Thin = RustKind == LLVMRustArchiveKind::GNUThin;
+  bool CollectSymbols =
+      ReuseSymbols && WriteSymbtab && RustKind == LLVMRustArchiveKind::GNU;
+
+  StringSet<> RemovalSet;
+  for (size_t I = 0; I < NumRemovals; I++)
+    RemovalSet.insert(Removals[I]);
+
+  LoadedMembers Loaded;
+  if (!loadArchiveMembers(NumMembers, NewMembers, Loaded, Thin ? Dst : nullptr,
+                          CollectSymbols))
+    return LLVMRustResult::Failure;
+
+  // An update reuses the symbol table of `Src` if there is one to write.
+  if (RustKind == LLVMRustArchiveKind::GNU && (!WriteSymbtab || ReuseSymbols)) {
+    Expected<bool> UpdatedOrErr =
+        updateGNUArchive(Dst, Src, RemovalSet, Loaded, WriteSymbtab);
+    if (!UpdatedOrErr) {
+      LLVMRustSetLastError(toString(UpdatedOrErr.takeError()).c_str());
+      return LLVMRustResult::Failure;
+    }
+    if (*UpdatedOrErr)
+      return LLVMRustResult::Success;
+  }
+
+  // Fall back to rewriting everything, with the members of `Src` first.
+  std::vector<RustArchiveMember> OldMembers;
+  Error Err = Error::success();
+  for (const Archive::Child &Child : Src.children(Err)) {
+    // Members without a name are skipped, like rustc does when iterating.
+    Expected<StringRef> NameOrErr = getMemberName(Child);
+    if (!NameOrErr) {
+      consumeError(NameOrErr.takeError());
+      continue;
+    }
+    if (RemovalSet.count(*NameOrErr))
+      continue;
+    OldMembers.emplace_back();
+    OldMembers.back().Name = "";
+    OldMembers.back().Child = Child;
+  }
+  if (Err) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  std::vector<LLVMRustArchiveMemberRef> OldMemberRefs;
+  for (RustArchiveMember &Member : OldMembers)
+    OldMemberRefs.push_back(&Member);
+  // The names of the new members still refer to `Loaded`.
+  LoadedMembers All;
+  if (!loadArchiveMembers(OldMemberRefs.size(), OldMemberRefs.data(), All,
+                          Thin ? Dst : nullptr, CollectSymbols))
+    return LLVMRustResult::Failure;
+  for (NewArchiveMember &Member : Loaded.Members)
+    All.Members.push_back(std::move(Member));
+  for (std::vector<std::string> &MemberSymbols : Loaded.Symbols)
+    All.Symbols.push_back(std::move(MemberSymbols));
+
+  return writeArchiveMembers(Dst, All, WriteSymbtab, RustKind);
+}
@@ -27,13 +27,23 @@ LLVMRustLinkerFree(RustLinker *L) {
   delete L;
 }
 
+// Links the module serialized in `BC` into the destination module.
+//
+// The bitcode is loaded lazily straight from the caller's buffer without
+// copying it: the source module is consumed by `linkInModule`, which
+// materializes only what it links, and is gone by the time this returns, so
+// the buffer only needs to outlive the call. Note that `Linker` only links
+// local, linkonce and available_externally definitions that have no
+// counterpart in the destination once something references them, so their
+// bodies are never even parsed otherwise. External definitions are always
+// linked: `Linker::LinkOnlyNeeded` would drop the ones nothing references
+// yet, but inputs linked later on or the exported symbols may still need them.
 extern "C" bool
-LLVMRustLinkerAdd(RustLinker *L, char *BC, size_t Len) {
-  std::unique_ptr<MemoryBuffer> Buf =
-      MemoryBuffer::getMemBufferCopy(StringRef(BC, Len));
+LLVMRustLinkerAdd(RustLinker *L, const char *BC, size_t Len) {
+  MemoryBufferRef Buf(StringRef(BC, Len), "");
 
   Expected<std::unique_ptr<Module>> SrcOrError =
-      llvm::getLazyBitcodeModule(Buf->getMemBufferRef(), L->Ctx);
+      llvm::getLazyBitcodeModule(Buf, L->Ctx);
   if (!SrcOrError) {
     LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
     return false;
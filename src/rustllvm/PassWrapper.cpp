@@ -1,10 +1,14 @@
 #include <stdio.h>
 
+#include <map>
+#include <mutex>
+#include <tuple>
 #include <vector>
 #include <set>
 
 #include "rustllvm.h"
 
+#include "llvm/ADT/SetVector.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/CodeGen/TargetSubtargetInfo.h"
@@ -18,8 +22,17 @@
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Transforms/IPO/FunctionImport.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/FunctionImportUtils.h"
 #include "llvm/LTO/LTO.h"
+#if LLVM_VERSION_GE(9, 0)
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Transforms/Utils/CanonicalizeAliases.h"
+#include "llvm/Transforms/Utils/NameAnonGlobals.h"
+#endif
 
 #include "llvm-c/Transforms/PassManagerBuilder.h"
 
@@ -50,6 +63,22 @@ extern "C" void LLVMInitializePasses() {
   initializeTarget(Registry);
 }
 
+// Records the enclosed work as an event named `Name` in LLVM's time-trace
+// profiler, with the identifier of the module it is done for as its detail.
+// Does nothing if the profiler isn't running or before LLVM 9.
+class RustTimeTraceScope {
+#if LLVM_VERSION_GE(9, 0)
+  TimeTraceScope Scope;
+
+public:
+  RustTimeTraceScope(StringRef Name, const Module &M)
+      : Scope(Name, M.getModuleIdentifier()) {}
+#else
+public:
+  RustTimeTraceScope(StringRef Name, const Module &M) {}
+#endif
+};
+
 enum class LLVMRustPassKind {
   Other,
   Function,
@@ -399,8 +428,111 @@ extern "C" LLVMTargetMachineRef LLVMRustCreateTargetMachine(
   return wrap(TM);
 }
 
-extern "C" void LLVMRustDisposeTargetMachine(LLVMTargetMachineRef TM) {
-  delete unwrap(TM);
+// A process-wide pool of target machines, keyed by all the arguments of
+// `LLVMRustCreateTargetMachine`. Creating a target machine means looking up
+// the target, parsing the feature string and building the subtarget tables,
+// which adds up when it is done for every codegen unit and every LTO job.
+//
+// `LLVMRustGetCachedTargetMachine` hands out an idle target machine with a
+// matching key if there is one, and creates a new one otherwise. Each target
+// machine is only ever used by one thread at a time: it is exclusively
+// borrowed until `LLVMRustDisposeTargetMachine` puts it back into the pool.
+struct TargetMachineKey {
+  std::string Triple;
+  std::string CPU;
+  std::string Feature;
+  LLVMRustCodeModel CodeModel;
+  LLVMRustRelocMode Reloc;
+  LLVMRustCodeGenOptLevel OptLevel;
+  unsigned Flags;
+
+  bool operator<(const TargetMachineKey &Other) const {
+    return std::tie(Triple, CPU, Feature, CodeModel, Reloc, OptLevel, Flags) <
+           std::tie(Other.Triple, Other.CPU, Other.Feature, Other.CodeModel,
+                    Other.Reloc, Other.OptLevel, Other.Flags);
+  }
+};
+
+typedef std::map<TargetMachineKey, std::vector<TargetMachine *>>
+    TargetMachineCacheTy;
+
+struct TargetMachineCache {
+  std::mutex Lock;
+  // Idle target machines for each key.
+  TargetMachineCacheTy Idle;
+  // The key of every target machine that was handed out by the cache.
+  DenseMap<TargetMachine *, TargetMachineCacheTy::iterator> Owner;
+};
+
+// This is deliberately leaked: the cached target machines must not be
+// destroyed by a static destructor after LLVM has already been shut down.
+static TargetMachineCache &getTargetMachineCache() {
+  static TargetMachineCache *Cache = new TargetMachineCache();
+  return *Cache;
+}
+
+extern "C" LLVMTargetMachineRef LLVMRustGetCachedTargetMachine(
+    const char *TripleStr, const char *CPU, const char *Feature,
+    LLVMRustCodeModel RustCM, LLVMRustRelocMode RustReloc,
+    LLVMRustCodeGenOptLevel RustOptLevel, bool UseSoftFloat,
+    bool PositionIndependentExecutable, bool FunctionSections,
+    bool DataSections,
+    bool TrapUnreachable,
+    bool Singlethread,
+    bool AsmComments,
+    bool EmitStackSizeSection) {
+  TargetMachineKey Key;
+  Key.Triple = TripleStr;
+  Key.CPU = CPU;
+  Key.Feature = Feature;
+  Key.CodeModel = RustCM;
+  Key.Reloc = RustReloc;
+  Key.OptLevel = RustOptLevel;
+  Key.Flags = UseSoftFloat << 0 | PositionIndependentExecutable << 1 |
+              FunctionSections << 2 | DataSections << 3 |
+              TrapUnreachable << 4 | Singlethread << 5 | AsmComments << 6 |
+              EmitStackSizeSection << 7;
+
+  TargetMachineCache &Cache = getTargetMachineCache();
+  {
+    std::lock_guard<std::mutex> Guard(Cache.Lock);
+    auto Entry = Cache.Idle.find(Key);
+    if (Entry != Cache.Idle.end() && !Entry->second.empty()) {
+      TargetMachine *TM = Entry->second.back();
+      Entry->second.pop_back();
+      return wrap(TM);
+    }
+  }
+
+  // Build the target machine without holding the lock, this is the expensive
+  // part that we want to be able to do concurrently.
+  LLVMTargetMachineRef TM = LLVMRustCreateTargetMachine(
+      TripleStr, CPU, Feature, RustCM, RustReloc, RustOptLevel, UseSoftFloat,
+      PositionIndependentExecutable, FunctionSections, DataSections,
+      TrapUnreachable, Singlethread, AsmComments, EmitStackSizeSection);
+  if (TM == nullptr)
+    return nullptr;
+
+  std::lock_guard<std::mutex> Guard(Cache.Lock);
+  auto Entry = Cache.Idle.insert(std::make_pair(Key, std::vector<TargetMachine *>()));
+  Cache.Owner[unwrap(TM)] = Entry.first;
+  return TM;
+}
+
+// Target machines that came from `LLVMRustGetCachedTargetMachine` are returned
+// to the pool for reuse, all others are destroyed.
+extern "C" void LLVMRustDisposeTargetMachine(LLVMTargetMachineRef TMR) {
+  TargetMachine *TM = unwrap(TMR);
+  TargetMachineCache &Cache = getTargetMachineCache();
+  {
+    std::lock_guard<std::mutex> Guard(Cache.Lock);
+    auto Owner = Cache.Owner.find(TM);
+    if (Owner != Cache.Owner.end()) {
+      Owner->second->second.push_back(TM);
+      return;
+    }
+  }
+  delete TM;
 }
 
 // Unfortunately, LLVM doesn't expose a C API to add the corresponding analysis
@@ -481,6 +613,194 @@ extern "C" void LLVMRustRunFunctionPassManager(LLVMPassManagerRef PMR,
   P->doFinalization();
 }
 
+enum class LLVMRustPassBuilderOptLevel {
+  Other,
+  O0,
+  O1,
+  O2,
+  O3,
+  Os,
+  Oz,
+};
+
+// The stage of the compilation pipeline that a module is optimized for. This
+// selects which of the `PassBuilder` default pipelines we build below.
+enum class LLVMRustOptStage {
+  Other,
+  PreLinkNoLTO,
+  PreLinkThinLTO,
+  PreLinkFatLTO,
+  ThinLTO,
+  FatLTO,
+};
+
+#if LLVM_VERSION_GE(9, 0)
+static PassBuilder::OptimizationLevel fromRust(LLVMRustPassBuilderOptLevel Level) {
+  switch (Level) {
+  case LLVMRustPassBuilderOptLevel::O0:
+    return PassBuilder::O0;
+  case LLVMRustPassBuilderOptLevel::O1:
+    return PassBuilder::O1;
+  case LLVMRustPassBuilderOptLevel::O2:
+    return PassBuilder::O2;
+  case LLVMRustPassBuilderOptLevel::O3:
+    return PassBuilder::O3;
+  case LLVMRustPassBuilderOptLevel::Os:
+    return PassBuilder::Os;
+  case LLVMRustPassBuilderOptLevel::Oz:
+    return PassBuilder::Oz;
+  default:
+    report_fatal_error("Bad PassBuilderOptLevel.");
+  }
+}
+
+// This is the counterpart of `LLVMRustConfigurePassManagerBuilder` and
+// `LLVMRustRunFunctionPassManager` for the new pass manager: it builds the
+// whole pipeline with a `PassBuilder` and runs it over the module in one go.
+// The structure roughly follows `EmitAssemblyWithNewPassManager` in clang's
+// `lib/CodeGen/BackendUtil.cpp`.
+//
+// Note that inlining thresholds are derived from the optimization level by
+// the `PassBuilder` itself, and that each of the `ExtraPasses` is a textual
+// new pass manager pipeline (e.g. "function(instcombine)"), which is appended
+// to the default pipeline.
+extern "C" LLVMRustResult
+LLVMRustOptimizeWithNewPassManager(
+    LLVMModuleRef ModuleRef,
+    LLVMTargetMachineRef TMRef,
+    LLVMRustPassBuilderOptLevel OptLevelRust,
+    LLVMRustOptStage OptStage,
+    bool NoPrepopulatePasses, bool VerifyIR, bool UseThinLTOBuffers,
+    bool MergeFunctions, bool UnrollLoops, bool SLPVectorize, bool LoopVectorize,
+    bool DisableSimplifyLibCalls,
+    const char *PGOGenPath, const char *PGOUsePath,
+    const char **ExtraPasses, size_t NumExtraPasses) {
+  Module *TheModule = unwrap(ModuleRef);
+  TargetMachine *TM = unwrap(TMRef);
+  PassBuilder::OptimizationLevel OptLevel = fromRust(OptLevelRust);
+
+  // FIXME: MergeFunctions is not supported by the new pass manager yet. The
+  // session warns when `-Z merge-functions` asks for it explicitly.
+  (void) MergeFunctions;
+
+  PipelineTuningOptions PTO;
+  PTO.LoopUnrolling = UnrollLoops;
+  PTO.LoopInterleaving = UnrollLoops;
+  PTO.LoopVectorization = LoopVectorize;
+  PTO.SLPVectorization = SLPVectorize;
+
+  Optional<PGOOptions> PGOOpt;
+  if (PGOGenPath) {
+    assert(!PGOUsePath);
+    PGOOpt = PGOOptions(PGOGenPath, "", "", PGOOptions::IRInstr);
+  } else if (PGOUsePath) {
+    assert(!PGOGenPath);
+    PGOOpt = PGOOptions(PGOUsePath, "", "", PGOOptions::IRUse);
+  }
+
+  PassBuilder PB(TM, PTO, PGOOpt);
+
+  // FIXME: We may want to expose this as an option.
+  bool DebugPassManager = false;
+  LoopAnalysisManager LAM(DebugPassManager);
+  FunctionAnalysisManager FAM(DebugPassManager);
+  CGSCCAnalysisManager CGAM(DebugPassManager);
+  ModuleAnalysisManager MAM(DebugPassManager);
+
+  FAM.registerPass([&] { return PB.buildDefaultAAPipeline(); });
+
+  Triple TargetTriple(TheModule->getTargetTriple());
+  std::unique_ptr<TargetLibraryInfoImpl> TLII(new TargetLibraryInfoImpl(TargetTriple));
+  if (DisableSimplifyLibCalls)
+    TLII->disableAllFunctions();
+  FAM.registerPass([&] { return TargetLibraryAnalysis(*TLII); });
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM(DebugPassManager);
+  if (VerifyIR)
+    MPM.addPass(VerifierPass());
+
+  if (!NoPrepopulatePasses) {
+    if (OptLevel == PassBuilder::O0) {
+      // The `PassBuilder` has no pipeline for O0, so mirror what
+      // `LLVMRustAddAlwaysInlinePass` does for the legacy pass manager.
+      MPM.addPass(AlwaysInlinerPass(/*InsertLifetimeIntrinsics=*/false));
+    } else {
+      switch (OptStage) {
+      case LLVMRustOptStage::PreLinkNoLTO:
+        MPM.addPass(PB.buildPerModuleDefaultPipeline(OptLevel, DebugPassManager));
+        break;
+      case LLVMRustOptStage::PreLinkThinLTO:
+        MPM.addPass(PB.buildThinLTOPreLinkDefaultPipeline(OptLevel, DebugPassManager));
+        break;
+      case LLVMRustOptStage::PreLinkFatLTO:
+        MPM.addPass(PB.buildLTOPreLinkDefaultPipeline(OptLevel, DebugPassManager));
+        break;
+      case LLVMRustOptStage::ThinLTO:
+        // The combined index is only used for C++ specific optimizations
+        // (whole program devirtualization), so we don't pass it in.
+        MPM.addPass(PB.buildThinLTODefaultPipeline(OptLevel, DebugPassManager, nullptr));
+        break;
+      case LLVMRustOptStage::FatLTO:
+        MPM.addPass(PB.buildLTODefaultPipeline(OptLevel, DebugPassManager, nullptr));
+        break;
+      default:
+        report_fatal_error("Bad OptStage.");
+      }
+    }
+  }
+
+  // Each extra pass is parsed on its own, so that function and module passes
+  // can be freely mixed: the `PassBuilder` wraps every pipeline in the
+  // appropriate adaptor based on its first pass.
+  for (size_t I = 0; I < NumExtraPasses; I++) {
+    if (auto Err = PB.parsePassPipeline(MPM, ExtraPasses[I], VerifyIR,
+                                        DebugPassManager)) {
+      std::string ErrMsg = toString(std::move(Err));
+      LLVMRustSetLastError(ErrMsg.c_str());
+      return LLVMRustResult::Failure;
+    }
+  }
+
+  // Bitcode is always emitted through `LLVMRustThinLTOBufferCreate`, which
+  // requires that anonymous globals have been named.
+  if (UseThinLTOBuffers) {
+    MPM.addPass(CanonicalizeAliasesPass());
+    MPM.addPass(NameAnonGlobalPass());
+  }
+
+  if (VerifyIR)
+    MPM.addPass(VerifierPass());
+
+  // Upgrade all calls to old intrinsics first.
+  for (Module::iterator I = TheModule->begin(), E = TheModule->end(); I != E;)
+    UpgradeCallsToIntrinsic(&*I++); // must be post-increment, as we remove
+
+  MPM.run(*TheModule, MAM);
+  return LLVMRustResult::Success;
+}
+#else
+extern "C" LLVMRustResult
+LLVMRustOptimizeWithNewPassManager(
+    LLVMModuleRef ModuleRef,
+    LLVMTargetMachineRef TMRef,
+    LLVMRustPassBuilderOptLevel OptLevelRust,
+    LLVMRustOptStage OptStage,
+    bool NoPrepopulatePasses, bool VerifyIR, bool UseThinLTOBuffers,
+    bool MergeFunctions, bool UnrollLoops, bool SLPVectorize, bool LoopVectorize,
+    bool DisableSimplifyLibCalls,
+    const char *PGOGenPath, const char *PGOUsePath,
+    const char **ExtraPasses, size_t NumExtraPasses) {
+  LLVMRustSetLastError("the new pass manager requires LLVM 9 or later");
+  return LLVMRustResult::Failure;
+}
+#endif
+
 extern "C" void LLVMRustSetLLVMOptions(int Argc, char **Argv) {
   // Initializing the command-line options more than once is not allowed. So,
   // check if they've already been initialized.  (This could happen if we're
@@ -493,56 +813,39 @@ extern "C" void LLVMRustSetLLVMOptions(int Argc, char **Argv) {
   cl::ParseCommandLineOptions(Argc, Argv);
 }
 
-enum class LLVMRustFileType {
-  Other,
-  AssemblyFile,
-  ObjectFile,
-};
-
-static TargetMachine::CodeGenFileType fromRust(LLVMRustFileType Type) {
-  switch (Type) {
-  case LLVMRustFileType::AssemblyFile:
-    return TargetMachine::CGFT_AssemblyFile;
-  case LLVMRustFileType::ObjectFile:
-    return TargetMachine::CGFT_ObjectFile;
-  default:
-    report_fatal_error("Bad FileType.");
-  }
-}
-
-extern "C" LLVMRustResult
-LLVMRustWriteOutputFile(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
-                        LLVMModuleRef M, const char *Path,
-                        LLVMRustFileType RustFileType) {
-  llvm::legacy::PassManager *PM = unwrap<llvm::legacy::PassManager>(PMR);
-  auto FileType = fromRust(RustFileType);
-
-  std::string ErrorInfo;
+// Runs codegen for `M` with a fresh pass manager and writes the result to
+// `Path`. Returns an error message, or an empty string on success. This does
+// the same work as `LLVMRustAddAnalysisPasses` and `LLVMRustAddLibraryInfo`
+// followed by `addPassesToEmitFile` on a rustc-created pass manager.
+static std::string emitToFile(TargetMachine &TM, Module &M, const char *Path,
+                              TargetMachine::CodeGenFileType FileType,
+                              bool DisableSimplifyLibCalls) {
+  RustTimeTraceScope TimeScope("WriteOutputFile", M);
   std::error_code EC;
   raw_fd_ostream OS(Path, EC, sys::fs::F_None);
   if (EC)
-    ErrorInfo = EC.message();
-  if (ErrorInfo != "") {
-    LLVMRustSetLastError(ErrorInfo.c_str());
-    return LLVMRustResult::Failure;
-  }
+    return EC.message();
 
 #if LLVM_VERSION_GE(7, 0)
   buffer_ostream BOS(OS);
-  unwrap(Target)->addPassesToEmitFile(*PM, BOS, nullptr, FileType, false);
+#endif
+  legacy::PassManager PM;
+  PM.add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+  if (DisableSimplifyLibCalls)
+    TLII.disableAllFunctions();
+  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+#if LLVM_VERSION_GE(7, 0)
+  bool Unsupported = TM.addPassesToEmitFile(PM, BOS, nullptr, FileType, false);
 #else
-  unwrap(Target)->addPassesToEmitFile(*PM, OS, FileType, false);
+  bool Unsupported = TM.addPassesToEmitFile(PM, OS, FileType, false);
 #endif
-  PM->run(*unwrap(M));
-
-  // Apparently `addPassesToEmitFile` adds a pointer to our on-the-stack output
-  // stream (OS), so the only real safe place to delete this is here? Don't we
-  // wish this was written in Rust?
-  delete PM;
-  return LLVMRustResult::Success;
+  if (Unsupported)
+    return "target does not support this output file type";
+  PM.run(M);
+  return std::string();
 }
 
-
 // Callback to demangle function name
 // Parameters:
 // * name to be demangled
@@ -555,39 +858,113 @@ typedef size_t (*DemangleFn)(const char*, size_t, char*, size_t);
 
 namespace {
 
+// Returns the callee of `I` that we annotate with its demangled name, if any,
+// and sets `Kind` to the instruction name to print in front of it.
+static const Value *getAnnotatedCallee(const Instruction *I,
+                                       const char **Kind) {
+  const Value *Callee;
+  if (const CallInst *CI = dyn_cast<CallInst>(I)) {
+    *Kind = "call";
+    Callee = CI->getCalledValue();
+  } else if (const InvokeInst* II = dyn_cast<InvokeInst>(I)) {
+    *Kind = "invoke";
+    Callee = II->getCalledValue();
+  } else {
+    // Could demangle more operations, e. g.
+    // `store %place, @function`.
+    return nullptr;
+  }
+
+  if (!Callee->hasName()) {
+    return nullptr;
+  }
+  return Callee;
+}
+
+// Demangles a single name through `Demangle`, using `Buf` as scratch space.
+// Returns an empty string if demangling failed or if the name does not need
+// to be demangled.
+static std::string demangleName(DemangleFn Demangle, StringRef Name,
+                                std::vector<char> &Buf) {
+  if (Buf.size() < Name.size() * 2) {
+    // Semangled name usually shorter than mangled,
+    // but allocate twice as much memory just in case
+    Buf.resize(Name.size() * 2);
+  }
+
+  auto R = Demangle(Name.data(), Name.size(), Buf.data(), Buf.size());
+  if (!R) {
+    // Demangle failed.
+    return std::string();
+  }
+
+  auto Demangled = StringRef(Buf.data(), R);
+  if (Demangled == Name) {
+    // Do not print anything if demangled name is equal to mangled.
+    return std::string();
+  }
+
+  return Demangled.str();
+}
+
 class RustAssemblyAnnotationWriter : public AssemblyAnnotationWriter {
   DemangleFn Demangle;
   std::vector<char> Buf;
+  // Demangled names by mangled name. Generic callees are often called from
+  // thousands of places, so every name is demangled only once.
+  StringMap<std::string> Cache;
 
 public:
   RustAssemblyAnnotationWriter(DemangleFn Demangle) : Demangle(Demangle) {}
 
-  // Return empty string if demangle failed
-  // or if name does not need to be demangled
-  StringRef CallDemangle(StringRef name) {
+  // Fills the cache with the demangled names of all functions and callees in
+  // `M` before it is printed.
+  void prepare(const Module &M) {
     if (!Demangle) {
-      return StringRef();
+      return;
     }
 
-    if (Buf.size() < name.size() * 2) {
-      // Semangled name usually shorter than mangled,
-      // but allocate twice as much memory just in case
-      Buf.resize(name.size() * 2);
+    // Reserve a cache entry for each name not seen before; they are filled
+    // in once all names have been demangled.
+    std::vector<StringMapEntry<std::string> *> Entries;
+    auto Add = [&](StringRef Name) {
+      auto Inserted = Cache.insert({Name, std::string()});
+      if (Inserted.second)
+        Entries.push_back(&*Inserted.first);
+    };
+    for (const Function &F : M) {
+      Add(F.getName());
+      for (const BasicBlock &BB : F) {
+        for (const Instruction &I : BB) {
+          const char *Kind;
+          if (const Value *Callee = getAnnotatedCallee(&I, &Kind))
+            Add(Callee->getName());
+        }
+      }
     }
 
-    auto R = Demangle(name.data(), name.size(), Buf.data(), Buf.size());
-    if (!R) {
-      // Demangle failed.
-      return StringRef();
-    }
+    // `Demangle` does not keep any state between calls, so large modules are
+    // demangled on multiple threads. Every chunk only writes to its own
+    // entries, and the map itself isn't modified until all of them are done.
+    parallelForChunks(Entries.size(), 1024, [&](size_t Begin, size_t End) {
+      std::vector<char> ChunkBuf;
+      for (size_t I = Begin; I < End; I++)
+        Entries[I]->second =
+            demangleName(Demangle, Entries[I]->first(), ChunkBuf);
+    });
+  }
 
-    auto Demangled = StringRef(Buf.data(), R);
-    if (Demangled == name) {
-      // Do not print anything if demangled name is equal to mangled.
+  // Return empty string if demangle failed
+  // or if name does not need to be demangled
+  StringRef CallDemangle(StringRef name) {
+    if (!Demangle) {
       return StringRef();
     }
 
-    return Demangled;
+    auto It = Cache.find(name);
+    if (It == Cache.end())
+      It = Cache.insert({name, demangleName(Demangle, name, Buf)}).first;
+    return It->second;
   }
 
   void emitFunctionAnnot(const Function *F,
@@ -603,20 +980,8 @@ public:
   void emitInstructionAnnot(const Instruction *I,
                             formatted_raw_ostream &OS) override {
     const char *Name;
-    const Value *Value;
-    if (const CallInst *CI = dyn_cast<CallInst>(I)) {
-      Name = "call";
-      Value = CI->getCalledValue();
-    } else if (const InvokeInst* II = dyn_cast<InvokeInst>(I)) {
-      Name = "invoke";
-      Value = II->getCalledValue();
-    } else {
-      // Could demangle more operations, e. g.
-      // `store %place, @function`.
-      return;
-    }
-
-    if (!Value->hasName()) {
+    const Value *Value = getAnnotatedCallee(I, &Name);
+    if (!Value) {
       return;
     }
 
@@ -629,61 +994,67 @@ public:
   }
 };
 
-class RustPrintModulePass : public ModulePass {
-  raw_ostream* OS;
-  DemangleFn Demangle;
-public:
-  static char ID;
-  RustPrintModulePass() : ModulePass(ID), OS(nullptr), Demangle(nullptr) {}
-  RustPrintModulePass(raw_ostream &OS, DemangleFn Demangle)
-      : ModulePass(ID), OS(&OS), Demangle(Demangle) {}
+} // namespace
 
-  bool runOnModule(Module &M) override {
+// Writes every requested artifact of `M` in one call: textual IR to `IRPath`,
+// assembly to `AsmPath` and an object file to `ObjPath`. Any of the paths may
+// be null if that artifact wasn't requested.
+//
+// LLVM's `AsmPrinter` drives exactly one `MCStreamer`, so there is no way to
+// share a single run of instruction selection between the assembly and the
+// object output. Codegen also mutates the module, so when both are requested
+// the assembly is emitted from a copy of the module first. The copy lives in
+// the context of `M`, so diagnostics and inline assembly errors still reach
+// the handlers rustc installed there.
+extern "C" LLVMRustResult
+LLVMRustWriteOutputFiles(LLVMTargetMachineRef Target, LLVMModuleRef M,
+                         const char *IRPath, const char *AsmPath,
+                         const char *ObjPath, bool DisableSimplifyLibCalls,
+                         DemangleFn Demangle) {
+  TargetMachine *TM = unwrap(Target);
+  Module *Mod = unwrap(M);
+
+  if (IRPath) {
+    std::error_code EC;
+    raw_fd_ostream OS(IRPath, EC, sys::fs::F_None);
+    if (EC) {
+      LLVMRustSetLastError(EC.message().c_str());
+      return LLVMRustResult::Failure;
+    }
+    formatted_raw_ostream FOS(OS);
+    RustTimeTraceScope TimeScope("PrintModule", *Mod);
     RustAssemblyAnnotationWriter AW(Demangle);
-
-    M.print(*OS, &AW, false);
-
-    return false;
+    AW.prepare(*Mod);
+    Mod->print(FOS, &AW, false);
   }
 
-  void getAnalysisUsage(AnalysisUsage &AU) const override {
-    AU.setPreservesAll();
+  if (AsmPath) {
+    std::unique_ptr<Module> AsmMod;
+    if (ObjPath) {
+#if LLVM_VERSION_GE(7, 0)
+      AsmMod = CloneModule(*Mod);
+#else
+      AsmMod = CloneModule(Mod);
+#endif
+    }
+    std::string Error = emitToFile(*TM, AsmMod ? *AsmMod : *Mod, AsmPath,
+                                   TargetMachine::CGFT_AssemblyFile,
+                                   DisableSimplifyLibCalls);
+    if (!Error.empty()) {
+      LLVMRustSetLastError(Error.c_str());
+      return LLVMRustResult::Failure;
+    }
   }
 
-  static StringRef name() { return "RustPrintModulePass"; }
-};
-
-} // namespace
-
-namespace llvm {
-  void initializeRustPrintModulePassPass(PassRegistry&);
-}
-
-char RustPrintModulePass::ID = 0;
-INITIALIZE_PASS(RustPrintModulePass, "print-rust-module",
-                "Print rust module to stderr", false, false)
-
-extern "C" LLVMRustResult
-LLVMRustPrintModule(LLVMPassManagerRef PMR, LLVMModuleRef M,
-                    const char *Path, DemangleFn Demangle) {
-  llvm::legacy::PassManager *PM = unwrap<llvm::legacy::PassManager>(PMR);
-  std::string ErrorInfo;
-
-  std::error_code EC;
-  raw_fd_ostream OS(Path, EC, sys::fs::F_None);
-  if (EC)
-    ErrorInfo = EC.message();
-  if (ErrorInfo != "") {
-    LLVMRustSetLastError(ErrorInfo.c_str());
-    return LLVMRustResult::Failure;
+  if (ObjPath) {
+    std::string Error = emitToFile(*TM, *Mod, ObjPath,
+                                   TargetMachine::CGFT_ObjectFile,
+                                   DisableSimplifyLibCalls);
+    if (!Error.empty()) {
+      LLVMRustSetLastError(Error.c_str());
+      return LLVMRustResult::Failure;
+    }
   }
-
-  formatted_raw_ostream FOS(OS);
-
-  PM->add(new RustPrintModulePass(FOS, Demangle));
-
-  PM->run(*unwrap(M));
-
   return LLVMRustResult::Success;
 }
 
@@ -812,6 +1183,16 @@ struct LLVMRustThinLTOData {
   StringMap<FunctionImporter::ExportSetTy> ExportLists;
   StringMap<GVSummaryMapTy> ModuleToDefinedGVSummaries;
 
+  // The new linkage of every linkonce/weak symbol whose linkage was changed by
+  // resolving prevailing copies, for each module.
+  StringMap<std::map<GlobalValue::GUID, GlobalValue::LinkageTypes>> ResolvedODR;
+
+  // The already located module of each bitcode file in `ModuleMap`, so that
+  // the import of every module doesn't scan the bitcode of its sources all
+  // over again. Imports run concurrently, hence the lock.
+  mutable std::mutex SourceModulesLock;
+  mutable StringMap<BitcodeModule> SourceModules;
+
 #if LLVM_VERSION_GE(7, 0)
   LLVMRustThinLTOData() : Index(/* HaveGVs = */ false) {}
 #endif
@@ -865,10 +1246,21 @@ LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
 
     Ret->ModuleMap[module->identifier] = mem_buffer;
 
-    if (Error Err = readModuleSummaryIndex(mem_buffer, Ret->Index, i)) {
+    auto BMsOrErr = getBitcodeModuleList(mem_buffer);
+    if (!BMsOrErr) {
+      LLVMRustSetLastError(toString(BMsOrErr.takeError()).c_str());
+      return nullptr;
+    }
+    if (BMsOrErr->size() != 1) {
+      LLVMRustSetLastError("Expected a single module");
+      return nullptr;
+    }
+    BitcodeModule &BM = BMsOrErr->front();
+    if (Error Err = BM.readSummary(Ret->Index, BM.getModuleIdentifier(), i)) {
       LLVMRustSetLastError(toString(std::move(Err)).c_str());
       return nullptr;
     }
+    Ret->SourceModules.insert(std::make_pair(BM.getModuleIdentifier(), BM));
   }
 
   // Collect for each module the list of function it defines (GUID -> Summary)
@@ -901,6 +1293,12 @@ LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
 #else
   computeDeadSymbols(Ret->Index, Ret->GUIDPreservedSymbols);
 #endif
+  // With `-C profile-use` the call edges in the summaries are annotated with
+  // their hotness, as `LLVMRustThinLTOBufferCreate` builds each summary after
+  // the pre-link pipeline applied the profile. The importer scales the
+  // instruction limit by `import-hot-multiplier` for hot edges and by
+  // `import-cold-multiplier` (zero by default, so nothing gets imported) for
+  // cold ones.
   ComputeCrossModuleImport(
     Ret->Index,
     Ret->ModuleToDefinedGVSummaries,
@@ -913,7 +1311,6 @@ LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
   //
   // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp` with some of this
   // being lifted from `lib/LTO/LTO.cpp` as well
-  StringMap<std::map<GlobalValue::GUID, GlobalValue::LinkageTypes>> ResolvedODR;
   DenseMap<GlobalValue::GUID, const GlobalValueSummary *> PrevailingCopy;
   for (auto &I : Ret->Index) {
     if (I.second.SummaryList.size() > 1)
@@ -928,7 +1325,7 @@ LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
   auto recordNewLinkage = [&](StringRef ModuleIdentifier,
                               GlobalValue::GUID GUID,
                               GlobalValue::LinkageTypes NewLinkage) {
-    ResolvedODR[ModuleIdentifier][GUID] = NewLinkage;
+    Ret->ResolvedODR[ModuleIdentifier][GUID] = NewLinkage;
   };
 #if LLVM_VERSION_GE(9, 0)
   thinLTOResolvePrevailingInIndex(Ret->Index, isPrevailing, recordNewLinkage,
@@ -981,6 +1378,7 @@ LLVMRustFreeThinLTOData(LLVMRustThinLTOData *Data) {
 extern "C" bool
 LLVMRustPrepareThinLTORename(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
+  RustTimeTraceScope TimeScope("ThinLTORename", Mod);
   if (renameModuleForThinLTO(Mod, Data->Index)) {
     LLVMRustSetLastError("renameModuleForThinLTO failed");
     return false;
@@ -991,6 +1389,7 @@ LLVMRustPrepareThinLTORename(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
 extern "C" bool
 LLVMRustPrepareThinLTOResolveWeak(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
+  RustTimeTraceScope TimeScope("ThinLTOResolveWeak", Mod);
   const auto &DefinedGlobals = Data->ModuleToDefinedGVSummaries.lookup(Mod.getModuleIdentifier());
 #if LLVM_VERSION_GE(8, 0)
   thinLTOResolvePrevailingInModule(Mod, DefinedGlobals);
@@ -1003,20 +1402,51 @@ LLVMRustPrepareThinLTOResolveWeak(const LLVMRustThinLTOData *Data, LLVMModuleRef
 extern "C" bool
 LLVMRustPrepareThinLTOInternalize(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
+  RustTimeTraceScope TimeScope("ThinLTOInternalize", Mod);
   const auto &DefinedGlobals = Data->ModuleToDefinedGVSummaries.lookup(Mod.getModuleIdentifier());
   thinLTOInternalizeModule(Mod, DefinedGlobals);
   return true;
 }
 
+// Returns the module in the bitcode of the source module `Identifier`.
+//
+// The parsed modules themselves can't be shared between imports: every
+// module being optimized lives in a context of its own, and the importer
+// moves the bodies it imports out of the source module. Locating the module
+// in the bitcode is independent of both though, so that part is done once per
+// source and cached in `Data`.
+static Expected<BitcodeModule>
+getThinLTOSourceModule(const LLVMRustThinLTOData *Data, StringRef Identifier) {
+  {
+    std::lock_guard<std::mutex> Lock(Data->SourceModulesLock);
+    auto It = Data->SourceModules.find(Identifier);
+    if (It != Data->SourceModules.end())
+      return It->second;
+  }
+  auto BMsOrErr = getBitcodeModuleList(Data->ModuleMap.lookup(Identifier));
+  if (!BMsOrErr)
+    return BMsOrErr.takeError();
+  if (BMsOrErr->size() != 1)
+    return make_error<StringError>("Expected a single module",
+                                   inconvertibleErrorCode());
+  BitcodeModule BM = BMsOrErr->front();
+  std::lock_guard<std::mutex> Lock(Data->SourceModulesLock);
+  Data->SourceModules.insert(std::make_pair(Identifier, BM));
+  return BM;
+}
+
 extern "C" bool
 LLVMRustPrepareThinLTOImport(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
+  RustTimeTraceScope TimeScope("ThinLTOImport", Mod);
 
   const auto &ImportList = Data->ImportLists.lookup(Mod.getModuleIdentifier());
   auto Loader = [&](StringRef Identifier) {
-    const auto &Memory = Data->ModuleMap.lookup(Identifier);
     auto &Context = Mod.getContext();
-    auto MOrErr = getLazyBitcodeModule(Memory, Context, true, true);
+    Expected<BitcodeModule> BMOrErr = getThinLTOSourceModule(Data, Identifier);
+    if (!BMOrErr)
+      return Expected<std::unique_ptr<Module>>(BMOrErr.takeError());
+    auto MOrErr = BMOrErr->getLazyModule(Context, true, true);
 
     if (!MOrErr)
       return MOrErr;
@@ -1077,6 +1507,46 @@ LLVMRustGetThinLTOModuleImports(const LLVMRustThinLTOData *data,
   }
 }
 
+// Computes a key for the result of running the ThinLTO backend on the module
+// `ModId`, the same way `lib/LTO/LTO.cpp` does for its cache. The key covers
+// the hash of the module and of every module it imports from, its import and
+// export lists, resolved linkages and the summaries of everything it defines.
+// If the key of a module didn't change since the last compilation, neither did
+// the optimized module, so any artifact built from it can be reused.
+extern "C" LLVMRustResult
+LLVMRustComputeLTOCacheKey(RustStringRef KeyOut, const char *ModId,
+                           const LLVMRustThinLTOData *Data) {
+#if LLVM_VERSION_GE(8, 0)
+  SmallString<40> Key;
+  lto::Config Conf;
+  const auto &ImportList = Data->ImportLists.lookup(ModId);
+  const auto &ExportList = Data->ExportLists.lookup(ModId);
+  const auto &ResolvedODR = Data->ResolvedODR.lookup(ModId);
+  const auto &DefinedGlobals = Data->ModuleToDefinedGVSummaries.lookup(ModId);
+
+  // This is copied from the `InProcessThinBackend` constructor in
+  // `lib/LTO/LTO.cpp`.
+  std::set<GlobalValue::GUID> CfiFunctionDefs;
+  std::set<GlobalValue::GUID> CfiFunctionDecls;
+  for (auto &Name : Data->Index.cfiFunctionDefs())
+    CfiFunctionDefs.insert(
+        GlobalValue::getGUID(GlobalValue::dropLLVMManglingEscape(Name)));
+  for (auto &Name : Data->Index.cfiFunctionDecls())
+    CfiFunctionDecls.insert(
+        GlobalValue::getGUID(GlobalValue::dropLLVMManglingEscape(Name)));
+
+  computeLTOCacheKey(Key, Conf, Data->Index, ModId, ImportList, ExportList,
+                     ResolvedODR, DefinedGlobals, CfiFunctionDefs,
+                     CfiFunctionDecls);
+
+  LLVMRustStringWriteImpl(KeyOut, Key.c_str(), Key.size());
+  return LLVMRustResult::Success;
+#else
+  LLVMRustSetLastError("computing ThinLTO cache keys requires LLVM 8 or later");
+  return LLVMRustResult::Failure;
+#endif
+}
+
 // This struct and various functions are sort of a hack right now, but the
 // problem is that we've got in-memory LLVM modules after we generate and
 // optimize all codegen-units for one compilation in rustc. To be compatible
@@ -1121,21 +1591,62 @@ LLVMRustThinLTOBufferLen(const LLVMRustThinLTOBuffer *Buffer) {
 // This is what we used to parse upstream bitcode for actual ThinLTO
 // processing.  We'll call this once per module optimized through ThinLTO, and
 // it'll be called concurrently on many threads.
+//
+// If `ThinData` is given the module is one of the inputs of that ThinLTO session,
+// and it's loaded lazily: function bodies which the combined index has proven
+// dead are turned into declarations before they're ever parsed, and only the
+// remaining bodies are materialized. This matches what `dropDeadSymbols` does
+// in LLVM's own ThinLTO backend, except that the dead bodies never cost any
+// parse time or memory. Everything else is materialized before returning, as
+// the steps that follow (and the pass pipeline) walk all function bodies.
+// LLVM 6 can't tell whether dead stripping ran at all, so it keeps every body.
 extern "C" LLVMModuleRef
 LLVMRustParseBitcodeForLTO(LLVMContextRef Context,
                            const char *data,
                            size_t len,
-                           const char *identifier) {
+                           const char *identifier,
+                           const LLVMRustThinLTOData *ThinData) {
   StringRef Data(data, len);
   MemoryBufferRef Buffer(Data, identifier);
   unwrap(Context)->enableDebugTypeODRUniquing();
+  if (!ThinData) {
+    Expected<std::unique_ptr<Module>> SrcOrError =
+        parseBitcodeFile(Buffer, *unwrap(Context));
+    if (!SrcOrError) {
+      LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
+      return nullptr;
+    }
+    return wrap(std::move(*SrcOrError).release());
+  }
+
   Expected<std::unique_ptr<Module>> SrcOrError =
-      parseBitcodeFile(Buffer, *unwrap(Context));
+      getLazyBitcodeModule(Buffer, *unwrap(Context),
+                           /* ShouldLazyLoadMetadata = */ true);
   if (!SrcOrError) {
     LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
     return nullptr;
   }
-  return wrap(std::move(*SrcOrError).release());
+  std::unique_ptr<Module> Src = std::move(*SrcOrError);
+
+#if LLVM_VERSION_GE(7, 0)
+  const auto &DefinedGlobals =
+      ThinData->ModuleToDefinedGVSummaries.lookup(identifier);
+  for (Function &F : *Src) {
+    if (!F.isMaterializable())
+      continue;
+    // Without dead stripping (`-compute-dead=false`) nothing in the index is
+    // marked live, so the flag only counts if the index says it was computed.
+    GlobalValueSummary *GVS = DefinedGlobals.lookup(F.getGUID());
+    if (GVS && !ThinData->Index.isGlobalValueLive(GVS))
+      convertToDeclaration(F);
+  }
+#endif
+
+  if (Error Err = Src->materializeAll()) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return nullptr;
+  }
+  return wrap(Src.release());
 }
 
 // Rewrite all `DICompileUnit` pointers to the `DICompileUnit` specified. See
@@ -1174,28 +1685,89 @@ LLVMRustThinLTOPatchDICompileUnit(LLVMModuleRef Mod, DICompileUnit *Unit) {
       return;
   }
 
-  // Use LLVM's built-in `DebugInfoFinder` to find a bunch of debuginfo and
-  // process it recursively. Note that we specifically iterate over instructions
-  // to ensure we feed everything into it.
-  DebugInfoFinder Finder;
-  Finder.processModule(*M);
+  // Every module rustc emits has a single `DICompileUnit`, and all of its
+  // subprograms are definitions belonging to it. Debuginfo pointing elsewhere
+  // can thus only have come in with imported functions and variables. These
+  // are either described by a subprogram of another unit themselves or, if
+  // they don't have any debuginfo of their own, are `available_externally`
+  // and may still carry locations, variables or a `!dbg` attachment from
+  // elsewhere. Only those are used as roots, rather than every instruction in
+  // the module.
+  SmallPtrSet<const MDNode *, 32> Visited;
+  SmallVector<const MDNode *, 32> Worklist;
+  auto AddRoot = [&](const Metadata *MD) {
+    auto *N = dyn_cast_or_null<MDNode>(MD);
+    if (N && N != Unit && Visited.insert(N).second)
+      Worklist.push_back(N);
+  };
   for (Function &F : M->functions()) {
+    DISubprogram *FSP = F.getSubprogram();
+    if (FSP ? FSP->getUnit() == Unit : !F.hasAvailableExternallyLinkage())
+      continue;
+    AddRoot(FSP);
     for (auto &FI : F) {
       for (Instruction &BI : FI) {
-        if (auto Loc = BI.getDebugLoc())
-          Finder.processLocation(*M, Loc);
+        AddRoot(BI.getDebugLoc().getAsMDNode());
         if (auto DVI = dyn_cast<DbgValueInst>(&BI))
-          Finder.processValue(*M, DVI);
-        if (auto DDI = dyn_cast<DbgDeclareInst>(&BI))
-          Finder.processDeclare(*M, DDI);
+          AddRoot(DVI->getVariable());
+        else if (auto DDI = dyn_cast<DbgDeclareInst>(&BI))
+          AddRoot(DDI->getVariable());
       }
     }
   }
+  for (GlobalVariable &GV : M->globals()) {
+    if (!GV.isDeclaration() && !GV.hasAvailableExternallyLinkage())
+      continue;
+    SmallVector<DIGlobalVariableExpression *, 1> GVEs;
+    GV.getDebugInfo(GVEs);
+    for (DIGlobalVariableExpression *GVE : GVEs)
+      AddRoot(GVE);
+  }
+
+  // Everything reachable from the roots may refer to a subprogram of another
+  // unit: scopes and inlined-at chains of locations, types (whose scope may be
+  // a function), retained nodes, and through the other unit itself its
+  // retained types, globals and imported entities. `Unit` is not entered, as
+  // nothing in it can point to another unit.
+  SetVector<DISubprogram *> Subprograms;
+  while (!Worklist.empty()) {
+    const MDNode *N = Worklist.pop_back_val();
+    if (auto *SP = dyn_cast<DISubprogram>(N))
+      if (SP->getUnit() && SP->getUnit() != Unit)
+        Subprograms.insert(const_cast<DISubprogram *>(SP));
+    for (const MDOperand &Op : N->operands())
+      AddRoot(Op);
+  }
+
+#ifndef NDEBUG
+  // Make sure the above didn't miss anything that the exhaustive search with
+  // LLVM's `DebugInfoFinder` over the whole module would have rewritten.
+  {
+    DebugInfoFinder Finder;
+    Finder.processModule(*M);
+    for (Function &F : M->functions()) {
+      for (auto &FI : F) {
+        for (Instruction &BI : FI) {
+          if (auto Loc = BI.getDebugLoc())
+            Finder.processLocation(*M, Loc);
+          if (auto DVI = dyn_cast<DbgValueInst>(&BI))
+            Finder.processValue(*M, DVI);
+          if (auto DDI = dyn_cast<DbgDeclareInst>(&BI))
+            Finder.processDeclare(*M, DDI);
+        }
+      }
+    }
+    for (DISubprogram *SP : Finder.subprograms())
+      assert((!SP->getUnit() || SP->getUnit() == Unit ||
+              Subprograms.count(SP)) &&
+             "subprogram from another DICompileUnit wasn't found");
+  }
+#endif
 
   // After we've found all our debuginfo, rewrite all subprograms to point to
   // the same `DICompileUnit`.
-  for (auto &F : Finder.subprograms()) {
-    F->replaceUnit(Unit);
+  for (DISubprogram *SP : Subprograms) {
+    SP->replaceUnit(Unit);
   }
 
   // Erase any other references to other `DICompileUnit` instances, the verifier
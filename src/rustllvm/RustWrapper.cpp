@@ -9,8 +9,17 @@
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Bitcode/BitcodeWriterPass.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/Statistic.h"
+#if LLVM_VERSION_GE(7, 0)
+#include "llvm/Support/JSON.h"
+#endif
+#if LLVM_VERSION_GE(9, 0)
+#include "llvm/Support/TimeProfiler.h"
+#endif
 
+#include <atomic>
 #include <iostream>
 
 //===----------------------------------------------------------------------===
@@ -70,6 +79,14 @@ extern "C" void LLVMRustInstallFatalErrorHandler() {
   install_fatal_error_handler(FatalErrorHandler);
 }
 
+static std::atomic<unsigned> MaxHelperThreads(1);
+
+unsigned getMaxHelperThreads() { return MaxHelperThreads; }
+
+extern "C" void LLVMRustSetMaxHelperThreads(unsigned Threads) {
+  MaxHelperThreads = std::max(1u, Threads);
+}
+
 extern "C" LLVMMemoryBufferRef
 LLVMRustCreateMemoryBufferWithContentsOfFile(const char *Path) {
   ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
@@ -108,6 +125,147 @@ extern "C" void LLVMRustPrintPassTimings() {
   TimerGroup::printAll(OS);
 }
 
+// LLVM's time-trace profiler, which records a Chrome trace of the work done in
+// the backend. Before LLVM 9 these functions do nothing.
+//
+// In LLVM 9 the profiler is a single global instance and isn't thread-safe,
+// so it may only be used while LLVM runs on one thread at a time.
+extern "C" void LLVMRustTimeTraceProfilerInitialize() {
+#if LLVM_VERSION_GE(9, 0)
+  timeTraceProfilerInitialize();
+#endif
+}
+
+extern "C" void LLVMRustTimeTraceProfilerBegin(const char *Name,
+                                               const char *Detail) {
+#if LLVM_VERSION_GE(9, 0)
+  timeTraceProfilerBegin(Name, Detail);
+#endif
+}
+
+extern "C" void LLVMRustTimeTraceProfilerEnd() {
+#if LLVM_VERSION_GE(9, 0)
+  timeTraceProfilerEnd();
+#endif
+}
+
+// Writes all events recorded so far to `Path` as Chrome trace JSON and stops
+// the profiler.
+extern "C" LLVMRustResult LLVMRustTimeTraceProfilerFinish(const char *Path) {
+#if LLVM_VERSION_GE(9, 0)
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+  if (EC) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return LLVMRustResult::Failure;
+  }
+  timeTraceProfilerWrite(OS);
+  timeTraceProfilerCleanup();
+#endif
+  return LLVMRustResult::Success;
+}
+
+// Makes LLVM collect `Statistic` counters without printing them on exit.
+// Counters are only compiled into LLVM builds with assertions enabled or
+// with `LLVM_FORCE_ENABLE_STATS`; pass timers need `-time-passes`.
+extern "C" void LLVMRustEnableStatistics() {
+  EnableStatistics(false);
+}
+
+// The values of all LLVM statistics and timers at one point in time, as
+// printed by `-stats-json`. Statistics and timers are global to the process,
+// so the difference between two snapshots taken around the work done for one
+// module is exact only as long as no other module is processed concurrently.
+struct LLVMRustStatisticsSnapshot {
+#if LLVM_VERSION_GE(7, 0)
+  json::Object Values;
+#endif
+};
+
+extern "C" LLVMRustStatisticsSnapshot *LLVMRustStatisticsSnapshotCreate() {
+#if LLVM_VERSION_GE(7, 0)
+  std::string Str;
+  {
+    raw_string_ostream OS(Str);
+    PrintStatisticsJSON(OS);
+  }
+  Expected<json::Value> Parsed = json::parse(Str);
+  if (!Parsed) {
+    LLVMRustSetLastError(toString(Parsed.takeError()).c_str());
+    return nullptr;
+  }
+  auto Ret = llvm::make_unique<LLVMRustStatisticsSnapshot>();
+  if (json::Object *Values = Parsed->getAsObject())
+    Ret->Values = std::move(*Values);
+  return Ret.release();
+#else
+  LLVMRustSetLastError("exporting LLVM statistics requires LLVM 7 or later");
+  return nullptr;
+#endif
+}
+
+extern "C" void
+LLVMRustStatisticsSnapshotFree(LLVMRustStatisticsSnapshot *Snapshot) {
+  delete Snapshot;
+}
+
+// Writes a JSON object describing the statistics and timers that changed
+// since `Before` was taken, tagged with the module name, the phase of the
+// compilation and the current thread:
+//
+//   { "module": "foo.1", "phase": "optimize", "thread": 1234,
+//     "statistics": { "instcombine.NumCombined": 42, ... },
+//     "timers": { "time.pass.Loop Vectorization.wall": 0.05, ... } }
+//
+// Statistic names are prefixed with the `DEBUG_TYPE` of the pass defining
+// them and timer names contain the pass name, so both are keyed by pass.
+extern "C" LLVMRustResult
+LLVMRustStatisticsSnapshotDiff(const LLVMRustStatisticsSnapshot *Before,
+                               const char *ModuleName, const char *Phase,
+                               RustStringRef Str) {
+#if LLVM_VERSION_GE(7, 0)
+  std::unique_ptr<LLVMRustStatisticsSnapshot> After(
+      LLVMRustStatisticsSnapshotCreate());
+  if (!After)
+    return LLVMRustResult::Failure;
+
+  json::Object Statistics;
+  json::Object Timers;
+  for (const auto &KV : After->Values) {
+    Optional<double> Value = KV.second.getAsNumber();
+    if (!Value)
+      continue;
+    double Delta = *Value;
+    auto OldKV = Before->Values.find(KV.first);
+    if (OldKV != Before->Values.end()) {
+      if (Optional<double> Old = OldKV->second.getAsNumber())
+        Delta -= *Old;
+    }
+    if (Delta == 0)
+      continue;
+
+    StringRef Key = KV.first;
+    if (Key.startswith("time."))
+      Timers[Key] = Delta;
+    else
+      Statistics[Key] = int64_t(Delta);
+  }
+
+  RawRustStringOstream OS(Str);
+  OS << json::Value(json::Object{
+      {"module", ModuleName},
+      {"phase", Phase},
+      {"thread", int64_t(get_threadid())},
+      {"statistics", std::move(Statistics)},
+      {"timers", std::move(Timers)},
+  });
+  return LLVMRustResult::Success;
+#else
+  LLVMRustSetLastError("exporting LLVM statistics requires LLVM 7 or later");
+  return LLVMRustResult::Failure;
+#endif
+}
+
 extern "C" LLVMValueRef LLVMRustGetNamedValue(LLVMModuleRef M,
                                               const char *Name) {
   return wrap(unwrap(M)->getNamedValue(Name));
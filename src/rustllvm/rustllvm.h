@@ -1,3 +1,5 @@
+#include <thread>
+
 #include "llvm-c/BitReader.h"
 #include "llvm-c/Core.h"
 #include "llvm-c/ExecutionEngine.h"
@@ -23,6 +25,7 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
@@ -114,3 +117,32 @@ public:
     flush();
   }
 };
+
+// The number of threads `parallelForChunks` may use, as configured by rustc
+// through `LLVMRustSetMaxHelperThreads`. This is 1 unless rustc was asked for
+// more, so helpers never run beside the jobserver's back by default.
+unsigned getMaxHelperThreads();
+
+// Calls `Fn(Begin, End)` for consecutive chunks of the range `[0, Count)` on
+// a thread pool and returns once all calls have finished. Every thread gets at
+// least `MinPerThread` elements, so small ranges are handled on this thread.
+static inline void
+parallelForChunks(size_t Count, size_t MinPerThread,
+                  llvm::function_ref<void(size_t, size_t)> Fn) {
+  size_t NumThreads = std::min<size_t>(
+      std::min(getMaxHelperThreads(),
+               std::max(1u, std::thread::hardware_concurrency())),
+      Count / MinPerThread + 1);
+  if (NumThreads == 1) {
+    Fn(0, Count);
+    return;
+  }
+
+  // The destructor of the pool waits for all jobs to finish.
+  llvm::ThreadPool Pool(NumThreads);
+  size_t Chunk = (Count + NumThreads - 1) / NumThreads;
+  for (size_t Begin = 0; Begin < Count; Begin += Chunk) {
+    size_t End = std::min(Begin + Chunk, Count);
+    Pool.async([=] { Fn(Begin, End); });
+  }
+}
@@ -0,0 +1,20 @@
+// Test that the optimization pipeline of the new pass manager runs when it is
+// requested with `-Z new-llvm-pass-manager`.
+
+// compile-flags: -C opt-level=3 -Z new-llvm-pass-manager
+// min-llvm-version 9.0
+
+#![crate_type = "lib"]
+
+#[inline]
+fn square(x: u32) -> u32 {
+    x * x
+}
+
+// CHECK-LABEL: @sum_of_squares
+#[no_mangle]
+pub fn sum_of_squares() -> u32 {
+    // CHECK-NOT: call
+    // CHECK: ret i32 385
+    (1..=10).map(square).sum()
+}
@@ -0,0 +1,49 @@
+// This test checks that the LTO phase is re-done for CGUs that stay untouched
+// but start exporting something via ThinLTO, even though nothing they import
+// from changes. The post-LTO version of such a CGU from the previous session
+// has not promoted the internal symbols the new importers refer to.
+
+// revisions: cfail1 cfail2 cfail3
+// compile-flags: -Z query-dep-graph -O
+// build-pass (FIXME(62277): could be check-pass?)
+
+#![feature(rustc_attrs)]
+#![crate_type="rlib"]
+
+#![rustc_expected_cgu_reuse(module="cgu_invalidated_via_export-foo",
+                            cfg="cfail2",
+                            kind="pre-lto")]
+#![rustc_expected_cgu_reuse(module="cgu_invalidated_via_export-foo",
+                            cfg="cfail3",
+                            kind="post-lto")]
+
+#![rustc_expected_cgu_reuse(module="cgu_invalidated_via_export-bar",
+                            cfg="cfail2",
+                            kind="no")]
+#![rustc_expected_cgu_reuse(module="cgu_invalidated_via_export-bar",
+                            cfg="cfail3",
+                            kind="post-lto")]
+
+pub use foo::lookup;
+
+mod foo {
+    static TABLE: [u32; 4] = [1, 2, 3, 4];
+
+    // Trivial functions like this one are imported very reliably by ThinLTO.
+    // Importing it into another module requires `TABLE` to be promoted.
+    pub fn lookup(i: usize) -> u32 {
+        TABLE[i & 3]
+    }
+}
+
+pub mod bar {
+    #[cfg(cfail1)]
+    pub fn caller(i: usize) -> u32 {
+        i as u32
+    }
+
+    #[cfg(not(cfail1))]
+    pub fn caller(i: usize) -> u32 {
+        ::foo::lookup(i)
+    }
+}
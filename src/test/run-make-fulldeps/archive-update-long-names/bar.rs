@@ -0,0 +1,7 @@
+#![crate_type = "dylib"]
+
+extern crate foo;
+
+pub fn baz() {
+    foo::baz();
+}
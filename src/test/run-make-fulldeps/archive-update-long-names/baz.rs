@@ -0,0 +1,5 @@
+extern crate bar;
+
+fn main() {
+    bar::baz();
+}
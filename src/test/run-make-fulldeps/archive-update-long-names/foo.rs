@@ -0,0 +1,14 @@
+#![crate_type = "rlib"]
+
+#[link(name = "native", kind = "static")]
+extern {
+    fn foo();
+    fn bar();
+}
+
+pub fn baz() {
+    unsafe {
+        foo();
+        bar();
+    }
+}
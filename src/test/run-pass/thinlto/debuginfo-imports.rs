@@ -0,0 +1,34 @@
+// run-pass
+
+// compile-flags: -Z thinlto -C codegen-units=8 -O -g -Z verify-llvm-ir
+// ignore-emscripten no debuginfo
+
+// Functions imported by ThinLTO bring debuginfo of their own codegen unit
+// along: their subprograms, but also closure types scoped to them, statics and
+// anything inlined into them. All of it has to be moved over to the unit of
+// the importing module, or the verifier rejects the module for referring to a
+// `DICompileUnit` that isn't listed in `llvm.dbg.cu`.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+mod a {
+    use super::*;
+
+    pub fn count() -> usize {
+        static COUNT: AtomicUsize = AtomicUsize::new(0);
+        let bump = |n: usize| COUNT.fetch_add(n, Ordering::SeqCst) + n;
+        bump(1) + b::double(bump(2))
+    }
+}
+
+mod b {
+    pub fn double(x: usize) -> usize {
+        let twice = move || x * 2;
+        twice()
+    }
+}
+
+fn main() {
+    assert_eq!(a::count(), 1 + 6);
+    assert_eq!(a::count(), 4 + 12);
+}
@@ -0,0 +1,29 @@
+// run-pass
+
+// compile-flags: -Z thinlto -C codegen-units=8 -O -C llvm-args=-compute-dead=false
+
+// With dead stripping disabled, no summary in the combined index is marked
+// live. Function bodies must then not be dropped while the modules are parsed
+// for ThinLTO, or the calls across codegen units below fail to link.
+
+pub fn foo() -> u32 {
+    bar::bar() + baz::baz()
+}
+
+mod bar {
+    #[inline(never)]
+    pub fn bar() -> u32 {
+        3
+    }
+}
+
+mod baz {
+    #[inline(never)]
+    pub fn baz() -> u32 {
+        super::bar::bar() * 2
+    }
+}
+
+fn main() {
+    assert_eq!(foo(), 9);
+}